@@ -0,0 +1,129 @@
+#include "codel.h"
+
+void codel_init(Codel *c)
+{
+	c->first_above = 0;
+	c->drop_next = 0;
+	c->count = 0;
+	c->lastcount = 0;
+	c->dropping = 0;
+}
+
+static u32 codel_isqrt(u32 v)
+{
+	u32 r = 0, bit = 1u << 30;
+	while(bit > v)
+	{
+		bit >>= 2;
+	}
+
+	while(bit)
+	{
+		if(v >= r + bit)
+		{
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		}
+		else
+		{
+			r >>= 1;
+		}
+
+		bit >>= 2;
+	}
+
+	return r;
+}
+
+static u64 codel_control_law(u64 t, u32 count)
+{
+	return t + CODEL_INTERVAL_US / codel_isqrt(count ? count : 1);
+}
+
+/* Pops the head frame into out and tells whether it may be dropped */
+static int codel_pop(Codel *c, NetQueue *q, u64 now, NetFrame *out)
+{
+	u64 sojourn;
+	if(!q->len)
+	{
+		c->first_above = 0;
+		return 0;
+	}
+
+	netq_pop(q, out);
+	sojourn = now - out->enqueued;
+	if(sojourn < CODEL_TARGET_US || !q->len)
+	{
+		c->first_above = 0;
+		return 0;
+	}
+
+	if(!c->first_above)
+	{
+		c->first_above = now + CODEL_INTERVAL_US;
+		return 0;
+	}
+
+	return now >= c->first_above;
+}
+
+/* Takes the next frame to send from q into out, handing the frames it
+   drops on the way to drop. Returns 0 if the queue ran empty. */
+int codel_dequeue(Codel *c, NetQueue *q, u64 now, NetFrame *out,
+	void (*drop)(NetFrame *f, void *ctx), void *ctx)
+{
+	int ok_to_drop;
+	if(!q->len)
+	{
+		c->first_above = 0;
+		c->dropping = 0;
+		return 0;
+	}
+
+	ok_to_drop = codel_pop(c, q, now, out);
+	if(c->dropping)
+	{
+		if(!ok_to_drop)
+		{
+			c->dropping = 0;
+		}
+
+		while(c->dropping && now >= c->drop_next)
+		{
+			drop(out, ctx);
+			++c->count;
+			if(!q->len)
+			{
+				c->dropping = 0;
+				return 0;
+			}
+
+			if(!(ok_to_drop = codel_pop(c, q, now, out)))
+			{
+				c->dropping = 0;
+			}
+			else
+			{
+				c->drop_next = codel_control_law(c->drop_next, c->count);
+			}
+		}
+	}
+	else if(ok_to_drop)
+	{
+		u32 delta = c->count - c->lastcount;
+		drop(out, ctx);
+		if(!q->len)
+		{
+			return 0;
+		}
+
+		codel_pop(c, q, now, out);
+		c->dropping = 1;
+		c->count = (delta > 1 && now - c->drop_next < 16 * CODEL_INTERVAL_US) ?
+			delta : 1;
+		c->drop_next = codel_control_law(now, c->count);
+		c->lastcount = c->count;
+	}
+
+	return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef __CODEL_H__
+#define __CODEL_H__
+
+#include "netq.h"
+
+#define CODEL_TARGET_US     5000
+#define CODEL_INTERVAL_US 100000
+
+/* Controlled delay queue management (RFC 8289). Frames are dropped at
+   the head once the time they spent queued stayed above the target for a
+   whole interval, at a rate that grows until the standing queue is
+   gone. */
+typedef struct
+{
+	u64 first_above;
+	u64 drop_next;
+	u32 count;
+	u32 lastcount;
+	int dropping;
+} Codel;
+
+void codel_init(Codel *c);
+int codel_dequeue(Codel *c, NetQueue *q, u64 now, NetFrame *out,
+	void (*drop)(NetFrame *f, void *ctx), void *ctx);
+
+#endif
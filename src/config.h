@@ -3,6 +3,45 @@
 
 #define PORT         8805
 #define MAXCLIENTS     16
+#define MAXROUTES    4096
+#define MAXGROUPS       8
 #define BUFSIZE      1024
+#define SENDBUFSIZE  (256 * 1024)
+#define BACKLOG       128
+#define ACCEPTBUDGET   16
+#define READQUANTUM  BUFSIZE
+#define BUSYPOLL_US     0
+#define NET_CPU        -1
+
+/* Forwarding admission limits in bytes per second and burst bytes,
+   0 disables a limit */
+#define RATE_SRC          (64 * 1024)
+#define RATE_SRC_BURST   (256 * 1024)
+#define RATE_LINK        (1024 * 1024)
+#define RATE_LINK_BURST  (1024 * 1024)
+#define RATE_SOURCES     1024
+#define LINK_STATE      0
+
+/* Routing updates merge sibling prefixes once the table holds at least
+   this many routes, 0 disables aggregation */
+#define RT_AGGREGATE_MIN  0
+
+/* Parts of a large routing update are cut from the table while fewer
+   bytes than this wait for the neighbour */
+#define RT_QUEUE_BYTES  (8 * BUFSIZE)
+
+/* Relayed messages are marked congested while more bytes than this wait
+   for the next hop */
+#define CE_MARK_BYTES   (32 * 1024)
+
+/* Payloads from this size on are compressed towards neighbours that
+   announce PVL_FEAT_LZ, 0 disables compression */
+#define LZ_MIN_SIZE      64
+
+/* Accepted files are received into this directory */
+#define XFER_DIR        "downloads"
+
+/* Overflow file of the store-and-forward spool, %s is our address */
+#define SPOOL_FILE      "spool-%s.dat"
 
 #endif
@@ -0,0 +1,61 @@
+#include "dedup.h"
+#include <string.h>
+
+void dedup_clear(Dedup *d)
+{
+	memset(d->bits, 0, sizeof(d->bits));
+	d->cur = 0;
+}
+
+void dedup_rotate(Dedup *d)
+{
+	d->cur ^= 1;
+	memset(d->bits[d->cur], 0, sizeof(d->bits[d->cur]));
+}
+
+static u64 dedup_hash(ip_addr src, u32 msgid)
+{
+	u64 h = ((u64)src << 32) | msgid;
+	h ^= h >> 30;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 27;
+	h *= 0x94D049BB133111EBull;
+	h ^= h >> 31;
+	return h;
+}
+
+static int dedup_test(const u64 *bits, u32 h1, u32 h2)
+{
+	for(int i = 0; i < DEDUP_HASHES; ++i)
+	{
+		u32 bit = (h1 + i * h2) % DEDUP_BITS;
+		if(!((bits[bit / 64] >> (bit % 64)) & 1))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Returns 1 if the pair was (probably) seen before, otherwise records
+   it and returns 0. False positives are rare at the rates one relay
+   sees within an interval. */
+int dedup_seen(Dedup *d, ip_addr src, u32 msgid)
+{
+	u64 h = dedup_hash(src, msgid);
+	u32 h1 = h, h2 = (h >> 32) | 1;
+	u64 *bits = d->bits[d->cur];
+	if(dedup_test(bits, h1, h2) || dedup_test(d->bits[d->cur ^ 1], h1, h2))
+	{
+		return 1;
+	}
+
+	for(int i = 0; i < DEDUP_HASHES; ++i)
+	{
+		u32 bit = (h1 + i * h2) % DEDUP_BITS;
+		bits[bit / 64] |= (u64)1 << (bit % 64);
+	}
+
+	return 0;
+}
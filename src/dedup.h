@@ -0,0 +1,23 @@
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include "net_util.h"
+
+#define DEDUP_BITS      (1 << 16)
+#define DEDUP_HASHES        3
+#define DEDUP_INTERVAL    100
+
+/* Rotating bloom filter of recently relayed (src, msgid) pairs. Pairs
+   are added to the current generation, a lookup checks both. Rotating
+   every DEDUP_INTERVAL ms keeps a pair for one to two intervals. */
+typedef struct
+{
+	u64 bits[2][DEDUP_BITS / 64];
+	int cur;
+} Dedup;
+
+void dedup_clear(Dedup *d);
+void dedup_rotate(Dedup *d);
+int dedup_seen(Dedup *d, ip_addr src, u32 msgid);
+
+#endif
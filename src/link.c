@@ -0,0 +1,120 @@
+#include "link.h"
+#include "util.h"
+#include <string.h>
+
+void links_init(Links *l, size_t max)
+{
+	l->len = 0;
+	l->cap = max;
+	l->links = smalloc(max * sizeof(Link));
+}
+
+void links_free(Links *l)
+{
+	for(size_t i = 0; i < l->len; ++i)
+	{
+		rtasm_free(&l->links[i].rt_asm);
+		sfree(l->links[i].rt_out);
+	}
+
+	sfree(l->links);
+}
+
+Link *link_find(Links *l, ip_addr addr)
+{
+	for(size_t i = 0; i < l->len; ++i)
+	{
+		if(l->links[i].addr == addr)
+		{
+			return l->links + i;
+		}
+	}
+
+	return NULL;
+}
+
+Link *link_add(Links *l, ip_addr addr)
+{
+	Link *link;
+	if((link = link_find(l, addr)))
+	{
+		return link;
+	}
+
+	if(l->len >= l->cap)
+	{
+		return NULL;
+	}
+
+	link = l->links + l->len++;
+	memset(link, 0, sizeof(*link));
+	link->addr = addr;
+	link->cost = LINK_DEFAULT_COST;
+	rtasm_init(&link->rt_asm);
+	return link;
+}
+
+void link_remove(Links *l, ip_addr addr)
+{
+	Link *link;
+	if(!(link = link_find(l, addr)))
+	{
+		return;
+	}
+
+	rtasm_free(&link->rt_asm);
+	sfree(link->rt_out);
+	*link = l->links[--l->len];
+}
+
+u32 link_cost(Links *l, ip_addr addr)
+{
+	Link *link = link_find(l, addr);
+	return link ? link->cost : LINK_DEFAULT_COST;
+}
+
+static u32 link_rtt_cost(u32 srtt)
+{
+	u32 cost = srtt / LINK_COST_UNIT_US;
+	return cost ? cost : 1;
+}
+
+/* Returns 1 if the advertised cost of the link changed. The cost only
+   follows the RTT once it drifts by more than LINK_COST_HYST_PCT, so
+   jitter does not trigger a routing update after every ping. */
+int link_rtt_sample(Link *link, u64 rtt)
+{
+	u32 cost, diff;
+	link->srtt = link->srtt ? (7 * (u64)link->srtt + rtt) / 8 : rtt;
+	if(link->cfg_cost)
+	{
+		return 0;
+	}
+
+	cost = link_rtt_cost(link->srtt);
+	diff = cost > link->cost ? cost - link->cost : link->cost - cost;
+	if((u64)diff * 100 <= (u64)link->cost * LINK_COST_HYST_PCT)
+	{
+		return 0;
+	}
+
+	link->cost = cost;
+	return 1;
+}
+
+/* A configured cost of 0 returns the link to RTT based costing */
+int link_set_cost(Link *link, u32 cost)
+{
+	u32 prev = link->cost;
+	link->cfg_cost = cost;
+	if(cost)
+	{
+		link->cost = cost;
+	}
+	else
+	{
+		link->cost = link->srtt ? link_rtt_cost(link->srtt) : LINK_DEFAULT_COST;
+	}
+
+	return link->cost != prev;
+}
@@ -0,0 +1,53 @@
+#ifndef __LINK_H__
+#define __LINK_H__
+
+#include "net.h"
+#include "net_util.h"
+#include "rtasm.h"
+
+#define LINK_COST_UNIT_US     100
+#define LINK_DEFAULT_COST      10
+#define LINK_COST_HYST_PCT     25
+#define LINK_PING_INTERVAL   2000
+
+/* rt_part of rt_parts is the next part of the routing update streamed
+   to the neighbour. The parts are cut from the table as it is sent,
+   unless the update is aggregated, which keeps its copy in rt_out;
+   rt_gen is the generation of the table the parts are cut from. */
+typedef struct
+{
+	ip_addr addr;
+	NetHandle conn;
+	u32 cost;
+	u32 cfg_cost;
+	u32 srtt;
+	u64 ping_sent;
+	u64 ping_due;
+	u32 features;
+	u32 lz_skip;
+	u32 lz_backoff;
+	RtAsm rt_asm;
+	u32 rt_epoch;
+	u32 rt_part;
+	u32 rt_parts;
+	u32 rt_gen;
+	Route *rt_out;
+	size_t rt_out_len;
+} Link;
+
+typedef struct
+{
+	size_t len, cap;
+	Link *links;
+} Links;
+
+void links_init(Links *l, size_t max);
+void links_free(Links *l);
+Link *link_find(Links *l, ip_addr addr);
+Link *link_add(Links *l, ip_addr addr);
+void link_remove(Links *l, ip_addr addr);
+u32 link_cost(Links *l, ip_addr addr);
+int link_rtt_sample(Link *link, u64 rtt);
+int link_set_cost(Link *link, u32 cost);
+
+#endif
@@ -0,0 +1,438 @@
+#include "lsdb.h"
+#include "util.h"
+#include <string.h>
+
+/* Link-state database with shortest path first calculation. Node dist,
+   hops and first hop set (fh, one bit per link of our own LSA) are kept
+   between runs, so an update that only shortens paths or touches links
+   outside the shortest path tree is applied incrementally. Anything
+   else falls back to a full Dijkstra run in lsdb_spf. */
+
+typedef struct
+{
+	u32 a, b;
+	u32 w_old, w_new;
+} EdgeChange;
+
+void lsdb_init(Lsdb *db, size_t max, ip_addr self)
+{
+	db->len = 0;
+	db->cap = max;
+	db->self = self;
+	db->full = 1;
+	db->nodes = smalloc(max * sizeof(LsNode));
+	db->heap_cap = max * (LS_MAX_LINKS + 1);
+	db->heap = smalloc(db->heap_cap * sizeof(LsHeapEntry));
+	db->heap_len = 0;
+	trie_init(&db->index, max);
+}
+
+void lsdb_free(Lsdb *db)
+{
+	sfree(db->nodes);
+	sfree(db->heap);
+	trie_free(&db->index);
+}
+
+void lsdb_clear(Lsdb *db)
+{
+	db->len = 0;
+	db->full = 1;
+	trie_clear(&db->index);
+}
+
+static u32 lsdb_index(Lsdb *db, ip_addr origin)
+{
+	return trie_find(&db->index, origin, 32);
+}
+
+LsNode *lsdb_find(Lsdb *db, ip_addr origin)
+{
+	u32 idx = lsdb_index(db, origin);
+	return idx == TRIE_NIL ? NULL : db->nodes + idx;
+}
+
+static void heap_push(Lsdb *db, u32 dist, u32 node)
+{
+	LsHeapEntry *heap = db->heap;
+	size_t i;
+	if(db->heap_len >= db->heap_cap)
+	{
+		db->full = 1;
+		return;
+	}
+
+	i = db->heap_len++;
+	while(i > 0)
+	{
+		size_t parent = (i - 1) / 2;
+		if(heap[parent].dist <= dist)
+		{
+			break;
+		}
+
+		heap[i] = heap[parent];
+		i = parent;
+	}
+
+	heap[i].dist = dist;
+	heap[i].node = node;
+}
+
+static LsHeapEntry heap_pop(Lsdb *db)
+{
+	LsHeapEntry *heap = db->heap;
+	LsHeapEntry top = heap[0], last = heap[--db->heap_len];
+	size_t i = 0, n = db->heap_len;
+	for(;;)
+	{
+		size_t child = 2 * i + 1;
+		if(child >= n)
+		{
+			break;
+		}
+
+		if(child + 1 < n && heap[child + 1].dist < heap[child].dist)
+		{
+			++child;
+		}
+
+		if(last.dist <= heap[child].dist)
+		{
+			break;
+		}
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = last;
+	return top;
+}
+
+static u32 lsdb_link_cost(const LsNode *n, ip_addr addr)
+{
+	for(u32 i = 0; i < n->num_links; ++i)
+	{
+		if(n->links[i].addr == addr)
+		{
+			return n->links[i].cost ? n->links[i].cost : 1;
+		}
+	}
+
+	return LS_INFINITY;
+}
+
+/* A link is only used if both ends advertise it */
+static u32 lsdb_weight(const LsNode *a, const LsNode *b)
+{
+	u32 cost = lsdb_link_cost(a, b->origin);
+	if(cost == LS_INFINITY || lsdb_link_cost(b, a->origin) == LS_INFINITY)
+	{
+		return LS_INFINITY;
+	}
+
+	return cost;
+}
+
+static u32 lsdb_first_hop(Lsdb *db, u32 a, u32 b)
+{
+	LsNode *na = db->nodes + a;
+	ip_addr addr = db->nodes[b].origin;
+	if(na->origin != db->self)
+	{
+		return na->fh;
+	}
+
+	for(u32 i = 0; i < na->num_links; ++i)
+	{
+		if(na->links[i].addr == addr)
+		{
+			return 1u << i;
+		}
+	}
+
+	return 0;
+}
+
+static void lsdb_relax_edge(Lsdb *db, u32 a, u32 b, u32 w)
+{
+	LsNode *na = db->nodes + a, *nb = db->nodes + b;
+	u64 nd;
+	u32 fh;
+	if(na->dist == LS_INFINITY || w == LS_INFINITY)
+	{
+		return;
+	}
+
+	nd = (u64)na->dist + w;
+	if(nd >= LS_INFINITY || nd > nb->dist)
+	{
+		return;
+	}
+
+	fh = lsdb_first_hop(db, a, b);
+	if(nd < nb->dist)
+	{
+		nb->dist = (u32)nd;
+		nb->hops = na->hops + 1;
+		nb->fh = fh;
+	}
+	else if((nb->fh | fh) != nb->fh)
+	{
+		nb->fh |= fh;
+	}
+	else
+	{
+		return;
+	}
+
+	heap_push(db, nb->dist, b);
+}
+
+static void lsdb_relax(Lsdb *db)
+{
+	while(db->heap_len)
+	{
+		LsHeapEntry e = heap_pop(db);
+		LsNode *n = db->nodes + e.node;
+		if(e.dist != n->dist)
+		{
+			continue;
+		}
+
+		for(u32 i = 0; i < n->num_links; ++i)
+		{
+			u32 v = lsdb_index(db, n->links[i].addr);
+			if(v != TRIE_NIL)
+			{
+				lsdb_relax_edge(db, e.node, v, lsdb_weight(n, db->nodes + v));
+			}
+		}
+	}
+}
+
+static size_t lsdb_changes(Lsdb *db, u32 u, const LsNode *lsa,
+	EdgeChange *out)
+{
+	LsNode *old = db->nodes + u;
+	size_t n = 0;
+	for(u32 pass = 0; pass < 2; ++pass)
+	{
+		const LsNode *list = pass ? lsa : old;
+		for(u32 i = 0; i < list->num_links; ++i)
+		{
+			ip_addr addr = list->links[i].addr;
+			u32 x = lsdb_index(db, addr), back;
+			u32 c_old, c_new;
+			if(x == TRIE_NIL || (pass && lsdb_link_cost(old, addr) != LS_INFINITY))
+			{
+				continue;
+			}
+
+			back = lsdb_link_cost(db->nodes + x, old->origin);
+			if(back == LS_INFINITY)
+			{
+				continue;
+			}
+
+			c_old = lsdb_link_cost(old, addr);
+			c_new = lsdb_link_cost(lsa, addr);
+			out[n].a = u;
+			out[n].b = x;
+			out[n].w_old = c_old;
+			out[n].w_new = c_new;
+			++n;
+			out[n].a = x;
+			out[n].b = u;
+			out[n].w_old = c_old == LS_INFINITY ? LS_INFINITY : back;
+			out[n].w_new = c_new == LS_INFINITY ? LS_INFINITY : back;
+			++n;
+		}
+	}
+
+	return n;
+}
+
+/* Returns 1 if one of the changes can lengthen a shortest path */
+static int lsdb_needs_full(Lsdb *db, const EdgeChange *c, size_t n)
+{
+	for(size_t i = 0; i < n; ++i)
+	{
+		u32 da = db->nodes[c[i].a].dist;
+		if(c[i].w_new > c[i].w_old && da != LS_INFINITY &&
+			c[i].w_old != LS_INFINITY &&
+			(u64)da + c[i].w_old == db->nodes[c[i].b].dist)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int lsdb_update(Lsdb *db, const LsNode *lsa, u64 now)
+{
+	EdgeChange changes[4 * LS_MAX_LINKS];
+	size_t num_changes = 0;
+	LsNode *n;
+	u32 idx = lsdb_index(db, lsa->origin);
+	if(idx != TRIE_NIL)
+	{
+		n = db->nodes + idx;
+		if(lsa->seq < n->seq)
+		{
+			return LSDB_STALE;
+		}
+
+		if(lsa->seq == n->seq)
+		{
+			n->received = now;
+			return LSDB_DUP;
+		}
+	}
+	else
+	{
+		if(db->len >= db->cap)
+		{
+			return LSDB_STALE;
+		}
+
+		idx = db->len;
+		n = db->nodes + idx;
+		memset(n, 0, sizeof(*n));
+		n->origin = lsa->origin;
+		n->dist = LS_INFINITY;
+		trie_insert(&db->index, lsa->origin, 32, idx);
+		++db->len;
+	}
+
+	if(lsa->origin == db->self)
+	{
+		db->full = 1;
+	}
+
+	if(!db->full)
+	{
+		num_changes = lsdb_changes(db, idx, lsa, changes);
+		db->full = lsdb_needs_full(db, changes, num_changes);
+	}
+
+	n->seq = lsa->seq;
+	n->received = now;
+	n->num_links = lsa->num_links < LS_MAX_LINKS ?
+		lsa->num_links : LS_MAX_LINKS;
+	memcpy(n->links, lsa->links, n->num_links * sizeof(LsLink));
+	if(!db->full)
+	{
+		for(size_t i = 0; i < num_changes; ++i)
+		{
+			if(changes[i].w_new < changes[i].w_old)
+			{
+				lsdb_relax_edge(db, changes[i].a, changes[i].b,
+					changes[i].w_new);
+			}
+		}
+
+		lsdb_relax(db);
+	}
+
+	return LSDB_NEW;
+}
+
+int lsdb_expire(Lsdb *db, u64 deadline)
+{
+	size_t i, n;
+	for(i = 0, n = 0; i < db->len; ++i)
+	{
+		LsNode *cur = db->nodes + i;
+		if(cur->origin == db->self || cur->received >= deadline)
+		{
+			db->nodes[n++] = *cur;
+		}
+	}
+
+	if(n == db->len)
+	{
+		return 0;
+	}
+
+	i = db->len - n;
+	db->len = n;
+	trie_clear(&db->index);
+	for(n = 0; n < db->len; ++n)
+	{
+		trie_insert(&db->index, db->nodes[n].origin, 32, n);
+	}
+
+	db->full = 1;
+	return i;
+}
+
+void lsdb_spf(Lsdb *db)
+{
+	u32 self;
+	if(!db->full)
+	{
+		return;
+	}
+
+	db->full = 0;
+	db->heap_len = 0;
+	for(size_t i = 0; i < db->len; ++i)
+	{
+		LsNode *cur = db->nodes + i;
+		cur->dist = LS_INFINITY;
+		cur->hops = 0;
+		cur->fh = 0;
+	}
+
+	if((self = lsdb_index(db, db->self)) == TRIE_NIL)
+	{
+		return;
+	}
+
+	db->nodes[self].dist = 0;
+	heap_push(db, 0, self);
+	lsdb_relax(db);
+}
+
+void lsdb_fill(Lsdb *db, RT *rt, u64 now)
+{
+	LsNode *self = lsdb_find(db, db->self);
+	rt_clear(rt);
+	if(!self)
+	{
+		return;
+	}
+
+	for(size_t i = 0; i < db->len; ++i)
+	{
+		LsNode *cur = db->nodes + i;
+		Route ins;
+		if(cur == self || cur->dist == LS_INFINITY)
+		{
+			continue;
+		}
+
+		ins.dst = cur->origin;
+		ins.plen = 32;
+		ins.hops = cur->hops;
+		ins.cost = cur->dist;
+		ins.num_via = 0;
+		for(u32 b = 0; b < self->num_links && ins.num_via < RT_MAX_PATHS; ++b)
+		{
+			if(cur->fh & (1u << b))
+			{
+				ins.refreshed[ins.num_via] = now;
+				ins.conn[ins.num_via] = 0;
+				ins.via[ins.num_via++] = self->links[b].addr;
+			}
+		}
+
+		if(ins.num_via)
+		{
+			rt_add(rt, &ins);
+		}
+	}
+}
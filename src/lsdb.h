@@ -0,0 +1,62 @@
+#ifndef __LSDB_H__
+#define __LSDB_H__
+
+#include "net_util.h"
+#include "trie.h"
+#include "rt.h"
+
+#define LS_MAX_LINKS          32
+#define LS_INFINITY  0xFFFFFFFFu
+#define LS_REFRESH_INTERVAL 20000
+#define LS_MAX_AGE          60000
+
+enum
+{
+	LSDB_STALE,
+	LSDB_DUP,
+	LSDB_NEW
+};
+
+typedef struct
+{
+	ip_addr addr;
+	u32 cost;
+} LsLink;
+
+typedef struct
+{
+	ip_addr origin;
+	u32 seq;
+	u64 received;
+	u32 num_links;
+	LsLink links[LS_MAX_LINKS];
+	u32 dist, hops, fh;
+} LsNode;
+
+typedef struct
+{
+	u32 dist;
+	u32 node;
+} LsHeapEntry;
+
+typedef struct
+{
+	size_t len, cap;
+	LsNode *nodes;
+	ip_addr self;
+	Trie index;
+	int full;
+	LsHeapEntry *heap;
+	size_t heap_len, heap_cap;
+} Lsdb;
+
+void lsdb_init(Lsdb *db, size_t max, ip_addr self);
+void lsdb_free(Lsdb *db);
+void lsdb_clear(Lsdb *db);
+LsNode *lsdb_find(Lsdb *db, ip_addr origin);
+int lsdb_update(Lsdb *db, const LsNode *lsa, u64 now);
+int lsdb_expire(Lsdb *db, u64 deadline);
+void lsdb_spf(Lsdb *db);
+void lsdb_fill(Lsdb *db, RT *rt, u64 now);
+
+#endif
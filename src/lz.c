@@ -0,0 +1,172 @@
+#include "lz.h"
+#include <string.h>
+
+/* LZ77 in the block format of LZ4: every sequence is a token holding
+   the literal and match length, the literals, and a 16 bit little endian
+   offset. The last sequence has literals only. */
+
+static u32 lz_read32(const u8 *p)
+{
+	u32 v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static u32 lz_hash(u32 v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static size_t lz_put_len(u8 *out, size_t len)
+{
+	size_t n = 0;
+	for(; len >= 255; len -= 255)
+	{
+		out[n++] = 255;
+	}
+
+	out[n++] = len;
+	return n;
+}
+
+/* Writes one sequence, without a match if mlen is 0. Returns the new
+   output position, 0 if the sequence doesn't fit. */
+static size_t lz_sequence(u8 *out, size_t op, size_t cap,
+	const u8 *lit, size_t llen, size_t off, size_t mlen)
+{
+	size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+	if(op + 1 + llen / 255 + 1 + llen + 2 + ml / 255 + 1 > cap)
+	{
+		return 0;
+	}
+
+	out[op++] = ((llen < 15 ? llen : 15) << 4) | (ml < 15 ? ml : 15);
+	if(llen >= 15)
+	{
+		op += lz_put_len(out + op, llen - 15);
+	}
+
+	memcpy(out + op, lit, llen);
+	op += llen;
+	if(!mlen)
+	{
+		return op;
+	}
+
+	out[op++] = off;
+	out[op++] = off >> 8;
+	if(ml >= 15)
+	{
+		op += lz_put_len(out + op, ml - 15);
+	}
+
+	return op;
+}
+
+/* Returns the compressed size, 0 if it would exceed cap */
+size_t lz_compress(const u8 *in, size_t n, u8 *out, size_t cap)
+{
+	u16 table[1 << LZ_HASH_BITS];
+	size_t ip = 0, anchor = 0, op = 0;
+	if(n > LZ_MAX_INPUT)
+	{
+		return 0;
+	}
+
+	memset(table, 0xFF, sizeof(table));
+	while(n >= LZ_MIN_MATCH && ip <= n - LZ_MIN_MATCH)
+	{
+		u32 seq = lz_read32(in + ip);
+		u32 h = lz_hash(seq);
+		size_t ref = table[h];
+		size_t len;
+		table[h] = ip;
+		if(ref == 0xFFFF || ref >= ip || lz_read32(in + ref) != seq)
+		{
+			++ip;
+			continue;
+		}
+
+		for(len = LZ_MIN_MATCH; ip + len < n && in[ref + len] == in[ip + len]; ++len) {}
+		if(!(op = lz_sequence(out, op, cap, in + anchor, ip - anchor, ip - ref, len)))
+		{
+			return 0;
+		}
+
+		ip += len;
+		anchor = ip;
+	}
+
+	return lz_sequence(out, op, cap, in + anchor, n - anchor, 0, 0);
+}
+
+static int lz_get_len(const u8 *in, size_t n, size_t *ip, size_t *len)
+{
+	u8 b;
+	do
+	{
+		if(*ip >= n)
+		{
+			return -1;
+		}
+
+		b = in[(*ip)++];
+		*len += b;
+	}
+	while(b == 255);
+	return 0;
+}
+
+/* Returns the decompressed size, -1 if the input is corrupt or would
+   exceed cap */
+ssize_t lz_decompress(const u8 *in, size_t n, u8 *out, size_t cap)
+{
+	size_t ip = 0, op = 0;
+	while(ip < n)
+	{
+		u8 token = in[ip++];
+		size_t llen = token >> 4, mlen = token & 15, off;
+		if(llen == 15 && lz_get_len(in, n, &ip, &llen))
+		{
+			return -1;
+		}
+
+		if(llen > n - ip || llen > cap - op)
+		{
+			return -1;
+		}
+
+		memcpy(out + op, in + ip, llen);
+		ip += llen;
+		op += llen;
+		if(ip == n)
+		{
+			break;
+		}
+
+		if(n - ip < 2)
+		{
+			return -1;
+		}
+
+		off = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		if((mlen == 15 && lz_get_len(in, n, &ip, &mlen)) || !off || off > op)
+		{
+			return -1;
+		}
+
+		mlen += LZ_MIN_MATCH;
+		if(mlen > cap - op)
+		{
+			return -1;
+		}
+
+		for(size_t i = 0; i < mlen; ++i, ++op)
+		{
+			out[op] = out[op - off];
+		}
+	}
+
+	return op;
+}
@@ -0,0 +1,14 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include "types.h"
+#include <sys/types.h>
+
+#define LZ_HASH_BITS    12
+#define LZ_MIN_MATCH     4
+#define LZ_MAX_INPUT 65535
+
+size_t lz_compress(const u8 *in, size_t n, u8 *out, size_t cap);
+ssize_t lz_decompress(const u8 *in, size_t n, u8 *out, size_t cap);
+
+#endif
@@ -7,11 +7,21 @@
 #include "net.h"
 #include "pvl.h"
 #include "rt.h"
+#include "link.h"
+#include "lsdb.h"
+#include "ratelimit.h"
 #include "util.h"
 #include "config.h"
 #include "layout.h"
 #include "terminal.h"
+#include "outbox.h"
+#include "rxwin.h"
+#include "dedup.h"
+#include "xfer.h"
+#include "lz.h"
 #include <stdarg.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include <SDL2/SDL.h>
 
 enum
@@ -26,8 +36,60 @@ static Net *net;
 static u32 cur_partner = 0;
 static int mode = MODE_LOGGER;
 static ip_addr my_ip;
-static u32 msg_id = 0;
 static RT rt, rt_prev;
+static Links links;
+static Lsdb lsdb;
+static u32 ls_seq;
+static int ls_mode = LINK_STATE;
+static RateTable rl_src, rl_link;
+
+/* Our own messages, sent by the GUI thread and acknowledged on the net
+   thread. Without a route they are spooled; relays don't spool, a
+   message without a route is NACKed back to its source. */
+static Outbox outbox;
+
+/* What was received from every source, only used by the net thread */
+static RxTab rxtab;
+static Dedup dedup;
+
+static int spool_due;
+
+static struct
+{
+	u64 rx_frames;
+	u64 rx_bytes;
+	u64 forwarded;
+	u64 rl_src_drops;
+	u64 rl_link_drops;
+	u64 crc_errors;
+	u64 delivered;
+	u64 acks_sent;
+	u64 duplicates;
+	u64 ce_marks;
+	u64 lz_in;
+	u64 lz_out;
+} stats;
+
+/* Commands on the GUI thread that change state the net thread owns, the
+   links, the routing table, the routing mode and the rate limits, are
+   queued here under cmd_lock and applied on its next tick */
+typedef struct
+{
+	ip_addr ip;
+	u32 cost;
+} CostChange;
+
+typedef struct
+{
+	int pending;
+	u32 rate, burst;
+} RateChange;
+
+static CostChange cost_new[MAXCLIENTS];
+static size_t num_cost_new;
+static int ls_mode_new = -1;
+static RateChange rl_src_new, rl_link_new;
+static pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct
 {
@@ -36,9 +98,28 @@ typedef struct
 	Terminal term;
 } Alias;
 
-static Alias names[MAXCLIENTS];
+static Alias names[MAXROUTES];
 static size_t numnames;
 
+/* A chat group is addressed by an id from 239.0.0.0/8, so it never
+   collides with a host and can have an alias and terminal of its own */
+typedef struct
+{
+	ip_addr id;
+	size_t num_members;
+	ip_addr members[PVL_MCAST_MAX];
+} Group;
+
+static Group groups[MAXGROUPS];
+static size_t numgroups;
+static u32 mcast_seq;
+static Dedup mcast_seen;
+
+/* File transfers in both directions */
+static Xfers xfers;
+static pthread_mutex_t xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+static u32 xfer_seq;
+
 static void addalias(ip_addr ip, const char *name)
 {
 	for(size_t i = 0; i < numnames; ++i)
@@ -50,6 +131,11 @@ static void addalias(ip_addr ip, const char *name)
 		}
 	}
 
+	if(numnames >= MAXROUTES)
+	{
+		return;
+	}
+
 	term_init(&names[numnames].term, 64);
 	strcpy(names[numnames].name, name);
 	names[numnames].ip = ip;
@@ -69,6 +155,32 @@ static char *getalias(ip_addr ip)
 	return NULL;
 }
 
+static ip_addr alias_find(const char *name)
+{
+	for(size_t i = 0; i < numnames; ++i)
+	{
+		if(!strcmp(names[i].name, name))
+		{
+			return names[i].ip;
+		}
+	}
+
+	return 0;
+}
+
+static Group *group_find(ip_addr id)
+{
+	for(size_t i = 0; i < numgroups; ++i)
+	{
+		if(groups[i].id == id)
+		{
+			return groups + i;
+		}
+	}
+
+	return NULL;
+}
+
 static Terminal *term_sel(ip_addr ip)
 {
 	for(size_t i = 0; i < numnames; ++i)
@@ -84,12 +196,19 @@ static Terminal *term_sel(ip_addr ip)
 
 static void update_gui_routes(void)
 {
-	size_t i;
-	for(i = 0; i < rt.len; ++i)
+	size_t i, n;
+	for(i = 0, n = 0; i < rt.len && n < MAXCLIENTS; ++i)
 	{
-		Button *b = lst_members + i;
-		ip_addr ip = rt.routes[i].dst;
-		char *al = getalias(ip);
+		Button *b;
+		ip_addr ip = rt.dst[i];
+		char *al;
+		if(rt.plen[i] != 32)
+		{
+			continue;
+		}
+
+		b = lst_members + n++;
+		al = getalias(ip);
 		if(al)
 		{
 			strcpy(b->Text, al);
@@ -99,19 +218,35 @@ static void update_gui_routes(void)
 			ip_to_str(b->Text, ip);
 		}
 
-		b->Tag = rt.routes[i].dst;
+		b->Tag = rt.dst[i];
+		b->Flags &= ~FLAG_INVISIBLE;
+	}
+
+	for(i = 0; i < numgroups && n < MAXCLIENTS; ++i)
+	{
+		Button *b = lst_members + n++;
+		strcpy(b->Text, getalias(groups[i].id));
+		b->Tag = groups[i].id;
 		b->Flags &= ~FLAG_INVISIBLE;
 	}
 
-	for(; i < MAXCLIENTS; ++i)
+	for(; n < MAXCLIENTS; ++n)
 	{
-		Button *b = lst_members + i;
+		Button *b = lst_members + n;
 		b->Flags |= FLAG_INVISIBLE;
 	}
 
 	gfx_notify();
 }
 
+/* Called after routes were added or changed, spooled messages are sent
+   once the frame or tick being handled is done */
+static void pvl_routes_changed(void)
+{
+	update_gui_routes();
+	spool_due = 1;
+}
+
 void net_log(const char *msg, ...)
 {
 	va_list args;
@@ -120,289 +255,1555 @@ void net_log(const char *msg, ...)
 	va_end(args);
 }
 
-static void pvl_send_rt(ip_addr dst)
+/* Routing, acknowledgements and link probes go ahead of queued chat
+   messages, so that a bulk transfer doesn't stall convergence or round
+   trip measurements */
+static u32 pvl_send_class(const u8 *buf)
 {
-	size_t len_bytes = rt.len * 8;
-	size_t size = PVL_HEADER_SIZE + len_bytes;
-	u8 *buf = scalloc(size);
-	pvl_set_version(buf);
-	pvl_set_msgtype(buf, PVL_ROUTING);
-	pvl_set_length(buf, len_bytes);
-	for(size_t i = 0; i < rt.len; ++i)
-	{
-		pvl_set_route_dst(buf, i, rt.routes[i].dst);
-		pvl_set_route_hops(buf, i, rt.routes[i].hops);
-	}
-
-	pvl_set_crc(buf, pvl_calc_crc(buf));
-	net_send(net, dst, buf, size);
+	return pvl_get_msgtype(buf) == PVL_MESSAGE ?
+		NET_PRIO_BULK : NET_PRIO_CONTROL;
 }
 
-static void pvl_broadcast_rt(void)
+#define LZ_MAX_BACKOFF 64
+
+/* Compresses the payload of buf, which frees it, and returns the frame
+   to send. Compression has to save an eighth to pay off; when it
+   doesn't, the link skips a growing number of attempts. */
+static u8 *pvl_deflate(Link *link, u8 *buf, size_t *size)
 {
-	for(size_t i = 0; i < rt.len; ++i)
+	size_t len = pvl_get_length(buf);
+	size_t head = *size - len;
+	size_t n;
+	u8 *out;
+	if(link->lz_skip)
 	{
-		Route *cur = rt.routes + i;
-		if(cur->hops != 1)
-		{
-			continue;
-		}
+		--link->lz_skip;
+		return buf;
+	}
 
-		pvl_send_rt(cur->via);
+	out = smalloc(*size);
+	if(!(n = lz_compress(buf + head, len, out + head + 2, len - len / 8 - 2)))
+	{
+		sfree(out);
+		link->lz_backoff = link->lz_backoff ?
+			(link->lz_backoff * 2 < LZ_MAX_BACKOFF ? link->lz_backoff * 2 : LZ_MAX_BACKOFF) : 1;
+		link->lz_skip = link->lz_backoff;
+		return buf;
 	}
+
+	link->lz_backoff = 0;
+	memcpy(out, buf, head);
+	out[head] = len >> 8;
+	out[head + 1] = len;
+	pvl_set_flags(out, PVL_FLAG_LZ);
+	pvl_set_length(out, n + 2);
+	pvl_set_crc(out, pvl_calc_crc(out));
+	stats.lz_in += len;
+	stats.lz_out += n + 2;
+	*size = head + n + 2;
+	sfree(buf);
+	return out;
 }
 
-void net_connected(ip_addr ip)
+/* Messages and routing tables are compressed per link, each neighbour
+   inflates them on arrival */
+static void pvl_net_send(NetHandle conn, ip_addr dst, u8 *buf, size_t size)
 {
-	char ipb[IPV4_STRBUF];
-	term_print(&logger, TAG_LOG, "%s connected", ip_to_str(ipb, ip));
-	rt_copy(&rt_prev, &rt);
-	rt_add_direct(&rt, ip);
-	addalias(ip, ipb);
-	update_gui_routes();
-	if(!rt_equals(&rt, &rt_prev))
+	u32 type = pvl_get_msgtype(buf);
+	Link *link;
+	if(LZ_MIN_SIZE && (type == PVL_MESSAGE || type == PVL_ROUTING ||
+		type == PVL_ROUTING_PART) && pvl_get_length(buf) >= LZ_MIN_SIZE &&
+		(link = link_find(&links, dst)) && (link->features & PVL_FEAT_LZ))
 	{
-		pvl_broadcast_rt();
+		buf = pvl_deflate(link, buf, &size);
 	}
+
+	net_send_to(net, conn, dst, pvl_send_class(buf), buf, size);
 }
 
-void net_disconnected(ip_addr ip)
+static void pvl_send_rt_part(ip_addr dst, const Route *routes, size_t count,
+	u32 epoch, u32 part, u32 parts)
 {
-	char ipb[IPV4_STRBUF];
-	term_print(&logger, TAG_LOG, "%s disconnected", ip_to_str(ipb, ip));
-	rt_copy(&rt_prev, &rt);
-	rt_remove_disconn(&rt, ip);
-	if(cur_partner == ip)
+	size_t len_bytes = PVL_RT_PART_HEADER_SIZE + count * PVL_ROUTE_SIZE;
+	size_t size = PVL_HEADER_SIZE + len_bytes;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_ROUTING_PART);
+	pvl_set_length(buf, len_bytes);
+	pvl_set_rt_epoch(buf, epoch);
+	pvl_set_rt_part(buf, part);
+	pvl_set_rt_parts(buf, parts);
+	for(size_t i = 0; i < count; ++i)
 	{
-		btn_logger_clicked(NULL);
+		pvl_set_route_dst(buf, i, routes[i].dst);
+		pvl_set_route_plen(buf, i, routes[i].plen);
+		pvl_set_route_hops(buf, i, routes[i].hops);
+		pvl_set_route_cost(buf, i, routes[i].cost);
 	}
 
-	if(!rt_equals(&rt, &rt_prev))
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(NET_HANDLE_NONE, dst, buf, size);
+}
+
+static void pvl_send_rt(ip_addr dst, const Route *routes, size_t count)
+{
+	size_t len_bytes = count * PVL_ROUTE_SIZE;
+	size_t size = PVL_HEADER_SIZE + len_bytes;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_ROUTING);
+	pvl_set_length(buf, len_bytes);
+	for(size_t i = 0; i < count; ++i)
 	{
-		pvl_broadcast_rt();
+		pvl_set_route_dst(buf, i, routes[i].dst);
+		pvl_set_route_plen(buf, i, routes[i].plen);
+		pvl_set_route_hops(buf, i, routes[i].hops);
+		pvl_set_route_cost(buf, i, routes[i].cost);
 	}
 
-	update_gui_routes();
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(NET_HANDLE_NONE, dst, buf, size);
 }
 
-static int pvl_send_msg(ip_addr dst, const char *msg, size_t len)
+/* Starts a routing update towards link. A table that fits into one frame
+   is sent right away; a larger one becomes a numbered epoch of parts
+   that pvl_stream_rt() sends. */
+static void pvl_start_rt(Link *link, int aggregate)
 {
-	ip_addr via = rt_get_via(&rt, dst);
-	if(!via)
+	static u32 epoch;
+	Route routes[PVL_RT_PART_ROUTES];
+	size_t count = rt.len;
+	sfree(link->rt_out);
+	link->rt_out = NULL;
+	link->rt_part = link->rt_parts = 0;
+	if(aggregate)
 	{
-		term_print(&logger, TAG_LOG, "No route to host");
-		return 1;
+		link->rt_out = smalloc((rt.len + 1) * sizeof(Route));
+		count = link->rt_out_len = rt_aggregate(&rt, link->rt_out, link->addr);
 	}
 
-	size_t size = PVL_HEADER_SIZE + PVL_MSG_HEADER_SIZE + len;
-	u8 *buf = scalloc(size);
-	pvl_set_version(buf);
-	pvl_set_msgtype(buf, PVL_MESSAGE);
-	pvl_set_length(buf, len);
-
-	pvl_set_dst(buf, dst);
-	pvl_set_src(buf, my_ip);
-	pvl_set_msgid(buf, msg_id);
-	++msg_id;
-
-	pvl_set_ttl(buf, 15);
-	pvl_set_msg_data(buf, msg, len);
+	if(count > PVL_RT_PART_ROUTES)
+	{
+		link->rt_epoch = ++epoch;
+		link->rt_parts = (count + PVL_RT_PART_ROUTES - 1) / PVL_RT_PART_ROUTES;
+		link->rt_gen = rt.gen;
+		return;
+	}
 
-	pvl_set_crc(buf, pvl_calc_crc(buf));
+	if(!link->rt_out)
+	{
+		for(size_t i = 0; i < count; ++i)
+		{
+			rt_get(&rt, i, routes + i);
+		}
+	}
 
-	net_send(net, via, buf, size);
-	return 0;
+	pvl_send_rt(link->addr, link->rt_out ? link->rt_out : routes, count);
+	sfree(link->rt_out);
+	link->rt_out = NULL;
 }
 
-static int pvl_send_ack(ip_addr dst, u32 msgid)
+/* Sends the next parts of the update of link while its control queue
+   holds less than RT_QUEUE_BYTES. Parts that are not aggregated are cut
+   from the table as they go, so the update is started over if the table
+   changed in between. Runs on the net thread, which owns the
+   queues. */
+static void pvl_stream_rt(Link *link)
 {
-	ip_addr via = rt_get_via(&rt, dst);
-	if(!via)
+	Route routes[PVL_RT_PART_ROUTES];
+	while(link->rt_part < link->rt_parts &&
+		net_queued(net, link->conn, link->addr, NET_PRIO_CONTROL) <
+			RT_QUEUE_BYTES)
 	{
-		term_print(&logger, TAG_LOG, "No route to host");
-		return 1;
-	}
+		size_t first = (size_t)link->rt_part * PVL_RT_PART_ROUTES;
+		size_t len = link->rt_out ? link->rt_out_len : rt.len;
+		const Route *part = routes;
+		size_t n;
+		if(!link->rt_out && rt.gen != link->rt_gen)
+		{
+			pvl_start_rt(link, 0);
+			continue;
+		}
 
-	size_t size = PVL_HEADER_SIZE + PVL_ACK_HEADER_SIZE;
-	u8 *buf = scalloc(size);
-	pvl_set_version(buf);
-	pvl_set_msgtype(buf, PVL_ACK);
-	pvl_set_length(buf, 0);
+		n = len - first < PVL_RT_PART_ROUTES ? len - first : PVL_RT_PART_ROUTES;
+		if(link->rt_out)
+		{
+			part = link->rt_out + first;
+		}
+		else
+		{
+			for(size_t i = 0; i < n; ++i)
+			{
+				rt_get(&rt, first + i, routes + i);
+			}
+		}
 
-	pvl_set_dst(buf, dst);
-	pvl_set_src(buf, my_ip);
-	pvl_set_msgid(buf, msgid);
-	pvl_set_ttl(buf, PVL_DEFAULT_TTL);
+		pvl_send_rt_part(link->addr, part, n, link->rt_epoch,
+			link->rt_part++, link->rt_parts);
+	}
 
-	pvl_set_crc(buf, pvl_calc_crc(buf));
-	net_send(net, via, buf, size);
-	return 0;
+	if(link->rt_part >= link->rt_parts && link->rt_out)
+	{
+		sfree(link->rt_out);
+		link->rt_out = NULL;
+	}
 }
 
-static int pvl_send_nack(ip_addr dst, u32 msgid, u32 status)
+/* Restarts the routing update of every neighbour from the current table,
+   an update still being streamed is abandoned */
+static void pvl_broadcast_rt(void)
 {
-	ip_addr via = rt_get_via(&rt, dst);
-	if(!via)
+	if(ls_mode)
 	{
-		term_print(&logger, TAG_LOG, "No route to host");
-		return 1;
+		return;
 	}
 
-	size_t size = PVL_HEADER_SIZE + PVL_NACK_HEADER_SIZE;
-	u8 *buf = scalloc(size);
-	pvl_set_version(buf);
-	pvl_set_msgtype(buf, PVL_NACK);
-	pvl_set_length(buf, 0);
-
-	pvl_set_dst(buf, dst);
-	pvl_set_src(buf, my_ip);
-	pvl_set_msgid(buf, msgid);
-	pvl_set_ttl(buf, PVL_DEFAULT_TTL);
-	pvl_set_nack_status(buf, status);
-
-	pvl_set_crc(buf, pvl_calc_crc(buf));
-	net_send(net, via, buf, size);
-	return 0;
+#if RT_AGGREGATE_MIN
+	int aggregate = rt.len >= RT_AGGREGATE_MIN;
+#else
+	int aggregate = 0;
+#endif
+	for(size_t i = 0; i < links.len; ++i)
+	{
+		pvl_start_rt(links.links + i, aggregate);
+	}
 }
 
-static void pvl_send_ping(ip_addr dst)
+static void pvl_send_lsa(ip_addr dst, const LsNode *lsa)
 {
-	size_t size = PVL_HEADER_SIZE;
+	size_t len_bytes = PVL_LSA_HEADER_SIZE + lsa->num_links * PVL_LSA_LINK_SIZE;
+	size_t size = PVL_HEADER_SIZE + len_bytes;
 	u8 *buf = scalloc(size);
 	pvl_set_version(buf);
-	pvl_set_msgtype(buf, PVL_PING);
-	pvl_set_length(buf, 0);
+	pvl_set_msgtype(buf, PVL_LSA);
+	pvl_set_length(buf, len_bytes);
+	pvl_set_lsa_origin(buf, lsa->origin);
+	pvl_set_lsa_seq(buf, lsa->seq);
+	for(u32 i = 0; i < lsa->num_links; ++i)
+	{
+		pvl_set_lsa_link_addr(buf, i, lsa->links[i].addr);
+		pvl_set_lsa_link_cost(buf, i, lsa->links[i].cost);
+	}
 
 	pvl_set_crc(buf, pvl_calc_crc(buf));
-	net_send(net, dst, buf, size);
+	pvl_net_send(NET_HANDLE_NONE, dst, buf, size);
 }
 
-static void pvl_send_pong(ip_addr dst)
+static void ls_flood(const LsNode *lsa, ip_addr except)
 {
-	size_t size = PVL_HEADER_SIZE;
-	u8 *buf = scalloc(size);
-	pvl_set_version(buf);
-	pvl_set_msgtype(buf, PVL_PONG);
-	pvl_set_length(buf, 0);
+	for(size_t i = 0; i < links.len; ++i)
+	{
+		if(links.links[i].addr != except)
+		{
+			pvl_send_lsa(links.links[i].addr, lsa);
+		}
+	}
+}
 
-	pvl_set_crc(buf, pvl_calc_crc(buf));
-	net_send(net, dst, buf, size);
+static void ls_sync(ip_addr dst)
+{
+	for(size_t i = 0; i < lsdb.len; ++i)
+	{
+		pvl_send_lsa(dst, lsdb.nodes + i);
+	}
 }
 
-static void pvl_print_ack(ip_addr src, u32 msgid, uint32_t m)
+static void ls_recompute(void)
 {
-	Terminal *term;
-	if(!(term = term_sel(src)))
+	rt_copy(&rt_prev, &rt);
+	lsdb_spf(&lsdb);
+	lsdb_fill(&lsdb, &rt, time_us());
+	if(rt_equals(&rt, &rt_prev))
 	{
 		return;
 	}
 
-	for(u32 i = 0; i < term->num_lines; ++i)
+	for(size_t i = 0; i < rt.len; ++i)
 	{
-		TLine *line = term_line(term, i);
-		if(!line)
-		{
-			break;
-		}
-
-		if(line->tag == msgid)
+		char ipb[IPV4_STRBUF];
+		if(!getalias(rt.dst[i]))
 		{
-			line->tag = m;
-			break;
+			addalias(rt.dst[i], ip_to_str(ipb, rt.dst[i]));
 		}
 	}
+
+	pvl_routes_changed();
 }
 
-static void pvl_print_msg(ip_addr src, u32 len, const char *buf)
+static void ls_originate(void)
 {
-	Terminal *term;
-	if(!(term = term_sel(src)))
+	LsNode lsa;
+	lsa.origin = my_ip;
+	lsa.seq = ++ls_seq;
+	lsa.num_links = 0;
+	for(size_t i = 0; i < links.len && i < LS_MAX_LINKS; ++i)
 	{
-		return;
+		lsa.links[i].addr = links.links[i].addr;
+		lsa.links[i].cost = links.links[i].cost;
+		++lsa.num_links;
 	}
 
-	term_print(term, TAG_RECV, "%.*s", len, buf);
+	lsdb_update(&lsdb, &lsa, time_us());
+	ls_flood(&lsa, 0);
+	ls_recompute();
 }
 
-static void pvl_print_my_msg(ip_addr src, u32 msgid, u32 len, const char *buf)
+static void pvl_handle_lsa(ip_addr ip, const u8 *buf)
 {
-	Terminal *term;
-	if(!(term = term_sel(src)))
+	int length = pvl_get_length(buf) - PVL_LSA_HEADER_SIZE;
+	LsNode lsa, *cur;
+	if(!ls_mode)
 	{
 		return;
 	}
 
-	term_print(term, msgid, "%.*s", len, buf);
-}
-
-static void pvl_handle_rt(u32 src, const u8 *buf)
-{
-	int length = pvl_get_length(buf);
-	printf("\n\n--- ROUTING INFO ---\n");
-	if(length % PVL_ROUTE_SIZE != 0)
+	if(length < 0 || length % PVL_LSA_LINK_SIZE != 0)
 	{
-		printf("Invalid routing table length %d, must be a multiple of PVL_ROUTE_SIZE = %d\n",
-			length, PVL_ROUTE_SIZE);
+		printf("Invalid LSA length %d\n", pvl_get_length(buf));
 		return;
 	}
 
-	rt_copy(&rt_prev, &rt);
-	rt_remove_via(&rt, src);
-
-	length /= PVL_ROUTE_SIZE;
-	for(int i = 0; i < length; ++i)
+	lsa.origin = pvl_get_lsa_origin(buf);
+	lsa.seq = pvl_get_lsa_seq(buf);
+	lsa.num_links = 0;
+	length /= PVL_LSA_LINK_SIZE;
+	for(int i = 0; i < length && i < LS_MAX_LINKS; ++i)
 	{
-		char ipb[IPV4_STRBUF];
-		Route ins = { pvl_get_route_dst(buf, i), src, pvl_get_route_hops(buf, i) + 1 };
+		lsa.links[i].addr = pvl_get_lsa_link_addr(buf, i);
+		lsa.links[i].cost = pvl_get_lsa_link_cost(buf, i);
+		++lsa.num_links;
+	}
 
-		ip_to_str(ipb, ins.dst);
-		if(ins.dst == my_ip || ins.dst == src)
+	if(lsa.origin == my_ip)
+	{
+		/* Our own advert from before a restart, continue above it */
+		if(lsa.seq >= ls_seq)
 		{
-			continue;
+			ls_seq = lsa.seq;
+			ls_originate();
 		}
-
-		printf("Route %d: Dst IP %s (%d Hops)\n", i, ipb, ins.hops);
-
-		rt_add(&rt, &ins);
-		addalias(ins.dst, ipb);
+		return;
 	}
 
-	if(!rt_equals(&rt, &rt_prev))
+	switch(lsdb_update(&lsdb, &lsa, time_us()))
 	{
-		pvl_broadcast_rt();
-		update_gui_routes();
+	case LSDB_NEW:
+		ls_flood(&lsa, ip);
+		ls_recompute();
+		break;
+
+	case LSDB_STALE:
+		if((cur = lsdb_find(&lsdb, lsa.origin)))
+		{
+			pvl_send_lsa(ip, cur);
+		}
+		break;
 	}
 }
 
-#define NACK_UNREACHABLE 1
-#define NACK_TTL         2
-#define NACK_CRC         3
-
-static void pvl_forward(const u8 *buf)
+static void ls_timers(u64 now)
 {
-	u32 len = pvl_total_len(buf);
-	ip_addr dst = pvl_get_dst(buf);
-	ip_addr src = pvl_get_src(buf);
-	ip_addr via = rt_get_via(&rt, dst);
-	if(!via)
+	static u64 next_refresh, next_sweep;
+	if(now >= next_sweep)
+	{
+		next_sweep = now + RT_SWEEP_INTERVAL * 1000;
+		if(lsdb_expire(&lsdb, now - LS_MAX_AGE * 1000))
+		{
+			ls_recompute();
+		}
+	}
+
+	if(now >= next_refresh)
+	{
+		next_refresh = now + LS_REFRESH_INTERVAL * 1000;
+		ls_originate();
+	}
+}
+
+static void ls_set_mode(int on)
+{
+	ls_mode = on;
+	lsdb_clear(&lsdb);
+	rt_clear(&rt);
+	if(on)
+	{
+		ls_originate();
+		for(size_t i = 0; i < links.len; ++i)
+		{
+			ls_sync(links.links[i].addr);
+		}
+	}
+	else
+	{
+		for(size_t i = 0; i < links.len; ++i)
+		{
+			rt_add_direct(&rt, links.links[i].addr, links.links[i].cost);
+		}
+
+		pvl_broadcast_rt();
+		pvl_routes_changed();
+	}
+}
+
+void net_connected(ip_addr ip, NetHandle handle)
+{
+	char ipb[IPV4_STRBUF];
+	Link *link;
+	term_print(&logger, TAG_LOG, "%s connected", ip_to_str(ipb, ip));
+	if((link = link_add(&links, ip)))
+	{
+		link->conn = handle;
+	}
+
+	addalias(ip, ipb);
+	if(ls_mode)
+	{
+		ls_originate();
+		ls_sync(ip);
+		return;
+	}
+
+	rt_copy(&rt_prev, &rt);
+	rt_add_direct(&rt, ip, link_cost(&links, ip));
+	rt_bind(&rt, ip, handle);
+	pvl_routes_changed();
+	if(!rt_equals(&rt, &rt_prev))
+	{
+		pvl_broadcast_rt();
+	}
+}
+
+void net_disconnected(ip_addr ip)
+{
+	char ipb[IPV4_STRBUF];
+	term_print(&logger, TAG_LOG, "%s disconnected", ip_to_str(ipb, ip));
+	link_remove(&links, ip);
+	if(cur_partner == ip)
+	{
+		btn_logger_clicked(NULL);
+	}
+
+	if(ls_mode)
+	{
+		ls_originate();
+		return;
+	}
+
+	rt_copy(&rt_prev, &rt);
+	rt_remove_disconn(&rt, ip);
+
+	if(!rt_equals(&rt, &rt_prev))
+	{
+		pvl_broadcast_rt();
+	}
+
+	pvl_routes_changed();
+}
+
+/* Resolves the next hop and the connection it is reached through. Paths
+   are bound to their neighbour's connection on first use, after that a
+   send costs no search by address. Binding writes the table, so only the
+   net thread may call this; the GUI thread posts its frames. */
+static ip_addr pvl_next_hop(ip_addr src, ip_addr dst, NetHandle *conn)
+{
+	Link *link;
+	ip_addr via = rt_get_hop_flow(&rt, src, dst, conn);
+	if(via && *conn == NET_HANDLE_NONE && (link = link_find(&links, via)))
+	{
+		*conn = link->conn;
+		rt_bind(&rt, via, link->conn);
+	}
+
+	return via;
+}
+
+/* A peer that reconnects is given a new handle, the handle of every
+   received frame keeps the binding current */
+static void pvl_update_conn(ip_addr ip, NetHandle handle)
+{
+	Link *link;
+	if((link = link_find(&links, ip)) && link->conn != handle)
+	{
+		link->conn = handle;
+		rt_bind(&rt, ip, handle);
+	}
+}
+
+static int pvl_send_ack(ip_addr dst, u32 msgid)
+{
+	NetHandle conn;
+	ip_addr via = pvl_next_hop(my_ip, dst, &conn);
+	if(!via)
+	{
+		term_print(&logger, TAG_LOG, "No route to host");
+		return 1;
+	}
+
+	size_t size = PVL_HEADER_SIZE + PVL_ACK_HEADER_SIZE;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_ACK);
+	pvl_set_length(buf, 0);
+
+	pvl_set_dst(buf, dst);
+	pvl_set_src(buf, my_ip);
+	pvl_set_msgid(buf, msgid);
+	pvl_set_ttl(buf, PVL_DEFAULT_TTL);
+
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(conn, via, buf, size);
+	++stats.acks_sent;
+	return 0;
+}
+
+static int pvl_send_sack(ip_addr dst, u32 top, u64 map, int ce)
+{
+	NetHandle conn;
+	ip_addr via = pvl_next_hop(my_ip, dst, &conn);
+	if(!via)
+	{
+		term_print(&logger, TAG_LOG, "No route to host");
+		return 1;
+	}
+
+	size_t size = PVL_HEADER_SIZE + PVL_SACK_HEADER_SIZE;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_SACK);
+	pvl_set_flags(buf, ce ? PVL_FLAG_CE : 0);
+	pvl_set_length(buf, 0);
+
+	pvl_set_dst(buf, dst);
+	pvl_set_src(buf, my_ip);
+	pvl_set_msgid(buf, top);
+	pvl_set_ttl(buf, PVL_DEFAULT_TTL);
+	pvl_set_sack_map(buf, map);
+
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(conn, via, buf, size);
+	++stats.acks_sent;
+	return 0;
+}
+
+static void pvl_flush_ack(RxPeer *p)
+{
+	pvl_send_sack(p->src, p->win.top, p->win.map, p->ce);
+	p->unacked = 0;
+	p->ce = 0;
+}
+
+/* Acknowledgements are delayed so that one SACK covers a burst. It goes
+   out after RX_ACK_EVERY messages, on the first tick after RX_ACK_DELAY,
+   or at once when a message arrives out of order or twice, as that
+   hints at a loss the sender should learn about quickly. A congestion
+   mark is echoed at once as well. Returns 0 if the message is a
+   duplicate. */
+static int pvl_ack_msg(ip_addr src, u32 msgid, int ce, u64 now)
+{
+	RxPeer *p;
+	int result;
+	if(!(p = rxtab_peer(&rxtab, src)))
+	{
+		pvl_send_ack(src, msgid);
+		return 1;
+	}
+
+	if((result = rxwin_update(&p->win, msgid)) == RX_TOO_OLD)
+	{
+		pvl_send_ack(src, msgid);
+		return 0;
+	}
+
+	if(!p->unacked++)
+	{
+		p->ack_due = now + RX_ACK_DELAY;
+	}
+
+	p->ce |= ce;
+	if(result != RX_IN_ORDER || p->unacked >= RX_ACK_EVERY || p->ce)
+	{
+		pvl_flush_ack(p);
+	}
+
+	return result != RX_DUPLICATE;
+}
+
+static int pvl_send_nack(ip_addr dst, u32 msgid, u32 status)
+{
+	NetHandle conn;
+	ip_addr via = pvl_next_hop(my_ip, dst, &conn);
+	if(!via)
+	{
+		term_print(&logger, TAG_LOG, "No route to host");
+		return 1;
+	}
+
+	size_t size = PVL_HEADER_SIZE + PVL_NACK_HEADER_SIZE;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_NACK);
+	pvl_set_length(buf, 0);
+
+	pvl_set_dst(buf, dst);
+	pvl_set_src(buf, my_ip);
+	pvl_set_msgid(buf, msgid);
+	pvl_set_ttl(buf, PVL_DEFAULT_TTL);
+	pvl_set_nack_status(buf, status);
+
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(conn, via, buf, size);
+	return 0;
+}
+
+static void pvl_send_ping(ip_addr dst)
+{
+	Link *link;
+	if((link = link_find(&links, dst)))
+	{
+		link->ping_sent = time_us();
+	}
+
+	size_t size = PVL_HEADER_SIZE + PVL_FEATURES_SIZE;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_PING);
+	pvl_set_length(buf, PVL_FEATURES_SIZE);
+	pvl_set_features(buf, LZ_MIN_SIZE ? PVL_FEAT_LZ : 0);
+
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(NET_HANDLE_NONE, dst, buf, size);
+}
+
+static void pvl_send_pong(ip_addr dst)
+{
+	size_t size = PVL_HEADER_SIZE + PVL_FEATURES_SIZE;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_PONG);
+	pvl_set_length(buf, PVL_FEATURES_SIZE);
+	pvl_set_features(buf, LZ_MIN_SIZE ? PVL_FEAT_LZ : 0);
+
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(NET_HANDLE_NONE, dst, buf, size);
+}
+
+static void pvl_link_cost_changed(ip_addr ip, u32 prev)
+{
+	u32 cost = link_cost(&links, ip);
+	if(ls_mode)
+	{
+		ls_originate();
+		return;
+	}
+
+	rt_copy(&rt_prev, &rt);
+	rt_set_link_cost(&rt, ip, prev, cost);
+	rt_add_direct(&rt, ip, cost);
+	if(!rt_equals(&rt, &rt_prev))
+	{
+		pvl_broadcast_rt();
+		pvl_routes_changed();
+	}
+}
+
+/* Pings and pongs carry the features of their sender, which is how
+   neighbours agree on compression */
+static void pvl_handle_features(ip_addr ip, const u8 *buf)
+{
+	Link *link;
+	if((link = link_find(&links, ip)))
+	{
+		link->features = pvl_get_features(buf);
+	}
+}
+
+static void pvl_handle_pong(ip_addr ip)
+{
+	Link *link;
+	u32 prev;
+	if(!(link = link_find(&links, ip)) || !link->ping_sent)
+	{
+		return;
+	}
+
+	prev = link->cost;
+	if(link_rtt_sample(link, time_us() - link->ping_sent))
+	{
+		pvl_link_cost_changed(ip, prev);
+	}
+
+	link->ping_sent = 0;
+}
+
+static void pvl_rl_apply(RateTable *t, RateChange *c)
+{
+	if(c->pending)
+	{
+		ratetab_set(t, c->rate, c->burst);
+		c->pending = 0;
+	}
+}
+
+static void pvl_set_cost(ip_addr ip, u32 cost)
+{
+	char ipb[IPV4_STRBUF];
+	Link *link;
+	u32 prev;
+	ip_to_str(ipb, ip);
+	if(!(link = link_find(&links, ip)))
+	{
+		term_print(&logger, TAG_LOG, "%s is not a neighbour", ipb);
+		return;
+	}
+
+	prev = link->cost;
+	if(link_set_cost(link, cost))
+	{
+		pvl_link_cost_changed(ip, prev);
+	}
+
+	term_print(&logger, TAG_LOG, "Link cost of %s is %d", ipb, link->cost);
+}
+
+/* Takes the queued commands under cmd_lock, the changes they cause are
+   made after it is released */
+static void pvl_apply_cmds(void)
+{
+	CostChange costs[MAXCLIENTS];
+	size_t num_costs;
+	int mode;
+	pthread_mutex_lock(&cmd_lock);
+	num_costs = num_cost_new;
+	memcpy(costs, cost_new, num_costs * sizeof(*costs));
+	num_cost_new = 0;
+	mode = ls_mode_new;
+	ls_mode_new = -1;
+	pvl_rl_apply(&rl_src, &rl_src_new);
+	pvl_rl_apply(&rl_link, &rl_link_new);
+	pthread_mutex_unlock(&cmd_lock);
+
+	for(size_t i = 0; i < num_costs; ++i)
+	{
+		pvl_set_cost(costs[i].ip, costs[i].cost);
+	}
+
+	if(mode >= 0)
+	{
+		ls_set_mode(mode);
+		term_print(&logger, TAG_LOG, "Routing mode: %s",
+			ls_mode ? "link-state" : "distance-vector");
+	}
+}
+
+static void pvl_rt_timers(u64 now)
+{
+	static u64 next_refresh, next_sweep;
+	if(now >= next_sweep)
+	{
+		next_sweep = now + RT_SWEEP_INTERVAL * 1000;
+		rt_copy(&rt_prev, &rt);
+		rt_expire(&rt, now - RT_EXPIRE_TIME * 1000);
+		if(!rt_equals(&rt, &rt_prev))
+		{
+			term_print(&logger, TAG_LOG, "Stale routes expired");
+			next_refresh = now;
+			pvl_routes_changed();
+		}
+	}
+
+	if(now >= next_refresh)
+	{
+		next_refresh = now + RT_REFRESH_INTERVAL * 1000;
+		pvl_broadcast_rt();
+	}
+}
+
+static void pvl_print_ack(ip_addr src, u32 msgid, uint32_t m)
+{
+	Terminal *term;
+	if(!(term = term_sel(src)))
+	{
+		return;
+	}
+
+	for(u32 i = 0; i < term->num_lines; ++i)
+	{
+		TLine *line = term_line(term, i);
+		if(!line)
+		{
+			break;
+		}
+
+		if(line->tag == msgid)
+		{
+			line->tag = m;
+			break;
+		}
+	}
+}
+
+static void pvl_print_msg(ip_addr src, u32 len, const char *buf)
+{
+	Terminal *term;
+	if(!(term = term_sel(src)))
+	{
+		return;
+	}
+
+	term_print(term, TAG_RECV, "%.*s", len, buf);
+}
+
+/* Shows a message in send order. One that arrives ahead of a gap waits
+   until the gap fills or is skipped after RX_GAP_SKIP. */
+static void pvl_deliver(ip_addr src, u32 msgid, u32 len, const char *text,
+	u64 now)
+{
+	RxPeer *p;
+	if(!(p = rxtab_peer(&rxtab, src)))
+	{
+		pvl_print_msg(src, len, text);
+		return;
+	}
+
+	rxpeer_deliver(p, msgid, text, len, now, pvl_print_msg);
+}
+
+static void pvl_ack_timers(u64 now)
+{
+	for(size_t i = 0; i < rxtab.len; ++i)
+	{
+		RxPeer *p = rxtab.peers + i;
+		if(p->unacked && now >= p->ack_due)
+		{
+			pvl_flush_ack(p);
+		}
+
+		rxpeer_timers(p, now, pvl_print_msg);
+	}
+}
+
+static void pvl_print_my_msg(ip_addr src, u32 msgid, u32 len, const char *buf)
+{
+	Terminal *term;
+	if(!(term = term_sel(src)))
+	{
+		return;
+	}
+
+	term_print(term, msgid, "%.*s", len, buf);
+}
+
+/* Transmits a message from the send window, also on retransmits. The
+   route is looked up every time, so a retransmit follows route changes;
+   without a route the next retransmit tries again. */
+static void pvl_tx_send(ip_addr dst, const u8 *frame, size_t len)
+{
+	u8 *buf = smalloc(len);
+	memcpy(buf, frame, len);
+	net_post(net, dst, buf, len);
+}
+
+static int pvl_routed(ip_addr dst)
+{
+	return rt_get_via(&rt, dst) != 0;
+}
+
+/* Marks the line of a message typed in the GUI. Runs on the net thread,
+   which prints into the terminals as it does for received messages. */
+static void pvl_tx_done(u32 handle, ip_addr dst, int status, u64 latency,
+	void *ctx)
+{
+	char ipb[IPV4_STRBUF];
+	pvl_print_ack(dst, handle, status == TX_ACKED ? TAG_ACK : TAG_NACK);
+	if(status == TX_TIMEOUT)
+	{
+		term_print(&logger, TAG_LOG, "Message to %s was not acknowledged "
+			"after %u ms", ip_to_str(ipb, dst), (u32)(latency / 1000));
+	}
+	else if(status == TX_DROPPED)
+	{
+		term_print(&logger, TAG_LOG, "Message to %s was dropped",
+			ip_to_str(ipb, dst));
+	}
+
+	(void)ctx;
+}
+
+/* Returns the number of routes in a PVL_ROUTING or PVL_ROUTING_PART
+   frame, or -1 if the length is invalid */
+static int pvl_rt_count(const u8 *buf, int header)
+{
+	int length = pvl_get_length(buf) - header;
+	if(length < 0 || length % PVL_ROUTE_SIZE != 0)
+	{
+		printf("Invalid routing table length %d, must be a multiple of PVL_ROUTE_SIZE = %d\n",
+			length, PVL_ROUTE_SIZE);
+		return -1;
+	}
+
+	return length / PVL_ROUTE_SIZE;
+}
+
+static void pvl_decode_rt(const u8 *buf, Route *routes, int count)
+{
+	for(int i = 0; i < count; ++i)
+	{
+		Route *r = routes + i;
+		r->plen = pvl_get_route_plen(buf, i);
+		r->dst = pvl_get_route_dst(buf, i) & ip_mask(r->plen);
+		r->hops = pvl_get_route_hops(buf, i);
+		r->cost = pvl_get_route_cost(buf, i);
+	}
+}
+
+/* Replaces everything learned from src by the advertised table. Known
+   paths are refreshed in place and the ones src no longer advertises
+   are dropped afterwards, so an unchanged table changes nothing. */
+static void pvl_apply_rt(u32 src, const Route *routes, size_t count)
+{
+	u64 now = time_us();
+	u32 lcost = link_cost(&links, src);
+	Link *link = link_find(&links, src);
+	NetHandle conn = link ? link->conn : NET_HANDLE_NONE;
+	printf("\n\n--- ROUTING INFO ---\n");
+	rt_copy(&rt_prev, &rt);
+	for(size_t i = 0; i < count; ++i)
+	{
+		char ipb[IPV4_STRBUF];
+		u32 plen = routes[i].plen;
+		Route ins =
+		{
+			routes[i].dst, plen,
+			routes[i].hops + 1,
+			routes[i].cost + lcost,
+			1, { src }, { now }, { conn }, { 0 }, { 0 }
+		};
+
+		ip_to_str(ipb, ins.dst);
+		if(plen > 32 || (plen == 32 && (ins.dst == my_ip || ins.dst == src)))
+		{
+			continue;
+		}
+
+		printf("Route %zu: Dst IP %s/%d (%d Hops, Cost %d)\n", i, ipb, plen, ins.hops, ins.cost);
+
+		rt_add(&rt, &ins);
+		if(plen == 32)
+		{
+			addalias(ins.dst, ipb);
+		}
+	}
+
+	rt_remove_stale(&rt, src, now);
+	if(!rt_equals(&rt, &rt_prev))
+	{
+		pvl_broadcast_rt();
+		pvl_routes_changed();
+	}
+}
+
+static void pvl_handle_rt(u32 src, const u8 *buf)
+{
+	Route *routes;
+	int count;
+	if(ls_mode || (count = pvl_rt_count(buf, 0)) < 0)
+	{
+		return;
+	}
+
+	routes = smalloc((count + 1) * sizeof(Route));
+	pvl_decode_rt(buf, routes, count);
+	pvl_apply_rt(src, routes, count);
+	sfree(routes);
+}
+
+static void pvl_handle_rt_part(u32 src, const u8 *buf)
+{
+	Route routes[PVL_RT_PART_ROUTES];
+	Link *link;
+	int count;
+	if(ls_mode || !(link = link_find(&links, src)) ||
+		(count = pvl_rt_count(buf, PVL_RT_PART_HEADER_SIZE)) < 0 ||
+		count > PVL_RT_PART_ROUTES)
+	{
+		return;
+	}
+
+	pvl_decode_rt(buf, routes, count);
+	if(rtasm_part(&link->rt_asm, pvl_get_rt_epoch(buf),
+		pvl_get_rt_part(buf), pvl_get_rt_parts(buf), routes, count,
+		2 * MAXROUTES / PVL_RT_PART_ROUTES + 1))
+	{
+		pvl_apply_rt(src, link->rt_asm.routes, link->rt_asm.len);
+		rtasm_free(&link->rt_asm);
+	}
+}
+
+#define NACK_UNREACHABLE 1
+#define NACK_TTL         2
+#define NACK_CRC         3
+#define NACK_CONGESTED   4
+
+/* Sends a relayed frame on with its TTL decremented. A message that
+   joins a queue above CE_MARK_BYTES is marked, which its receiver echoes
+   back so that the sender slows down before the queue overflows. */
+static void pvl_relay(const u8 *buf, ip_addr via, NetHandle conn)
+{
+	u32 len = pvl_total_len(buf);
+	int ttl = pvl_get_ttl(buf);
+	--ttl;
+	if(ttl <= 0)
+	{
+		term_print(&logger, TAG_LOG, "TTL expired");
+		pvl_send_nack(pvl_get_src(buf), pvl_get_msgid(buf), NACK_TTL);
+		return;
+	}
+
+	++stats.forwarded;
+	u8 *msg = smalloc(len);
+	memcpy(msg, buf, len);
+	pvl_set_ttl(msg, ttl);
+	if(pvl_get_msgtype(msg) == PVL_MESSAGE &&
+		net_queued(net, conn, via, NET_PRIO_BULK) > CE_MARK_BYTES)
+	{
+		++stats.ce_marks;
+		pvl_set_flags(msg, PVL_FLAG_CE);
+	}
+
+	pvl_set_crc(msg, pvl_calc_crc(msg));
+	pvl_net_send(conn, via, msg, len);
+}
+
+static void pvl_forward(const u8 *buf)
+{
+	ip_addr dst = pvl_get_dst(buf);
+	ip_addr src = pvl_get_src(buf);
+	NetHandle conn;
+	ip_addr via = pvl_next_hop(src, dst, &conn);
+	if(!via)
 	{
 		term_print(&logger, TAG_LOG, "No route to host while forwarding, sending NACK");
 		pvl_send_nack(src, pvl_get_msgid(buf), NACK_UNREACHABLE);
+		return;
 	}
 
-	int ttl = pvl_get_ttl(buf);
-	--ttl;
-	if(ttl <= 0)
+	pvl_relay(buf, via, conn);
+}
+
+/* Sends one copy of a multicast per next hop, carrying only the members
+   reached through it, so a shared link carries the text once. Members
+   without a route are left out. */
+static void pvl_mcast_split(const u8 *buf, u32 ttl)
+{
+	ip_addr src = pvl_get_src(buf);
+	u32 count = pvl_get_mcast_count(buf);
+	size_t data_len = pvl_get_length(buf) - 4 * count;
+	ip_addr vias[MAXCLIENTS];
+	NetHandle conns[MAXCLIENTS];
+	ip_addr members[MAXCLIENTS][PVL_MCAST_MAX];
+	u32 counts[MAXCLIENTS];
+	size_t num_vias = 0;
+	for(u32 i = 0; i < count; ++i)
+	{
+		ip_addr dst = pvl_get_mcast_dst(buf, i);
+		NetHandle conn;
+		ip_addr via;
+		size_t k;
+		if(dst == my_ip || !(via = pvl_next_hop(src, dst, &conn)))
+		{
+			continue;
+		}
+
+		for(k = 0; k < num_vias && vias[k] != via; ++k) {}
+		if(k == num_vias)
+		{
+			if(num_vias == MAXCLIENTS)
+			{
+				continue;
+			}
+
+			vias[k] = via;
+			conns[k] = conn;
+			counts[k] = 0;
+			++num_vias;
+		}
+
+		members[k][counts[k]++] = dst;
+	}
+
+	for(size_t k = 0; k < num_vias; ++k)
+	{
+		size_t length = 4 * counts[k] + data_len;
+		size_t size = PVL_HEADER_SIZE + PVL_MCAST_HEADER_SIZE + length;
+		u8 *copy = smalloc(size);
+		memcpy(copy, buf, PVL_HEADER_SIZE + PVL_MCAST_HEADER_SIZE);
+		pvl_set_length(copy, length);
+		pvl_set_ttl(copy, ttl);
+		pvl_set_mcast_count(copy, counts[k]);
+		for(u32 i = 0; i < counts[k]; ++i)
+		{
+			pvl_set_mcast_dst(copy, i, members[k][i]);
+		}
+
+		memcpy((u8 *)pvl_get_mcast_data(copy), pvl_get_mcast_data(buf), data_len);
+		pvl_set_crc(copy, pvl_calc_crc(copy));
+		if(src != my_ip)
+		{
+			++stats.forwarded;
+		}
+
+		pvl_net_send(conns[k], vias[k], copy, size);
+	}
+}
+
+/* Delivers a multicast if we are a member and passes it on to the
+   others. It is shown in the group's terminal if we know the group,
+   otherwise in the sender's. */
+static void pvl_handle_mcast(const u8 *buf)
+{
+	ip_addr src = pvl_get_src(buf);
+	ip_addr group = pvl_get_dst(buf);
+	u32 count = pvl_get_mcast_count(buf);
+	u32 ttl = pvl_get_ttl(buf);
+	if(count > PVL_MCAST_MAX || 4 * count > pvl_get_length(buf))
+	{
+		term_print(&logger, TAG_LOG, "Invalid multicast member count %u", count);
+		return;
+	}
+
+	for(u32 i = 0; i < count; ++i)
+	{
+		if(pvl_get_mcast_dst(buf, i) == my_ip)
+		{
+			if(!dedup_seen(&mcast_seen, src, pvl_get_msgid(buf)))
+			{
+				++stats.delivered;
+				pvl_print_msg(group_find(group) ? group : src,
+					pvl_get_length(buf) - 4 * count, pvl_get_mcast_data(buf));
+			}
+
+			break;
+		}
+	}
+
+	if(ttl > 1)
+	{
+		pvl_mcast_split(buf, ttl - 1);
+	}
+}
+
+/* Multicasts are not acknowledged, a lost copy is lost for all members
+   behind it. The frame is split on the net thread, which owns the routes.
+   Returns 1 if the frame would not fit the receive buffer of a relay. */
+static int pvl_send_mcast(const Group *g, const char *msg, size_t len)
+{
+	size_t length = 4 * g->num_members + len;
+	size_t size = PVL_HEADER_SIZE + PVL_MCAST_HEADER_SIZE + length;
+	u8 *buf;
+	if(size > BUFSIZE)
+	{
+		return 1;
+	}
+
+	buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_MULTICAST);
+	pvl_set_length(buf, length);
+
+	pvl_set_dst(buf, g->id);
+	pvl_set_src(buf, my_ip);
+	pvl_set_msgid(buf, ++mcast_seq);
+	pvl_set_mcast_count(buf, g->num_members);
+	for(size_t i = 0; i < g->num_members; ++i)
+	{
+		pvl_set_mcast_dst(buf, i, g->members[i]);
+	}
+
+	memcpy((u8 *)pvl_get_mcast_data(buf), msg, len);
+	net_post(net, g->id, buf, size);
+	return 0;
+}
+
+/* Routes the frames posted by the GUI thread. Without a frame a message
+   to dst was spooled. */
+void net_posted(ip_addr dst, void *buf, size_t len)
+{
+	NetHandle conn;
+	ip_addr via;
+	if(!buf)
+	{
+		if(!pvl_routed(dst))
+		{
+			term_print(&logger, TAG_LOG, "No route to host, message spooled");
+		}
+
+		outbox_flush(&outbox);
+		return;
+	}
+
+	if(pvl_get_msgtype(buf) == PVL_MULTICAST)
+	{
+		pvl_mcast_split(buf, PVL_DEFAULT_TTL);
+		sfree(buf);
+		return;
+	}
+
+	if(!(via = pvl_next_hop(my_ip, dst, &conn)))
+	{
+		sfree(buf);
+		return;
+	}
+
+	pvl_net_send(conn, via, buf, len);
+}
+
+static u8 *pvl_file_frame(u32 type, ip_addr dst, u32 id, u32 off,
+	size_t len)
+{
+	u8 *buf = smalloc(PVL_HEADER_SIZE + PVL_FILE_HEADER_SIZE + len);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, type);
+	pvl_set_length(buf, len);
+
+	pvl_set_dst(buf, dst);
+	pvl_set_src(buf, my_ip);
+	pvl_set_msgid(buf, id);
+	pvl_set_ttl(buf, PVL_DEFAULT_TTL);
+	pvl_set_file_off(buf, off);
+	return buf;
+}
+
+static void pvl_file_out(u8 *buf)
+{
+	NetHandle conn;
+	ip_addr via = pvl_next_hop(my_ip, pvl_get_dst(buf), &conn);
+	if(!via)
+	{
+		sfree(buf);
+		return;
+	}
+
+	pvl_set_crc(buf, pvl_calc_crc(buf));
+	pvl_net_send(conn, via, buf, pvl_total_len(buf));
+}
+
+static void pvl_send_file(u32 type, ip_addr dst, u32 id, u32 off,
+	const void *data, size_t len)
+{
+	u8 *buf = pvl_file_frame(type, dst, id, off, len);
+	pvl_set_file_data(buf, data, len);
+	pvl_file_out(buf);
+}
+
+static void pvl_xfer_offer(const XferSend *s)
+{
+	size_t len = strlen(s->name);
+	u8 *buf = pvl_file_frame(PVL_FILE_OFFER, s->dst, s->id, s->size,
+		PVL_FILE_SUM_SIZE + len);
+	pvl_set_file_sum(buf, s->sum);
+	pvl_set_file_name(buf, s->name, len);
+	pvl_file_out(buf);
+}
+
+/* Sends chunks straight from the mapped file while the window allows.
+   Each chunk is copied once, into the frame its CRC is computed over. */
+static void pvl_xfer_pump(XferSend *s)
+{
+	while(s->started && s->next < s->size &&
+		s->next - s->acked < XFER_WINDOW * XFER_CHUNK)
+	{
+		u32 len = s->size - s->next < XFER_CHUNK ? s->size - s->next : XFER_CHUNK;
+		pvl_send_file(PVL_FILE_CHUNK, s->dst, s->id, s->next,
+			s->map + s->next, len);
+		s->next += len;
+	}
+}
+
+static void pvl_xfer_ack(XferRecv *r)
+{
+	pvl_send_file(PVL_FILE_ACK, r->src, r->id, r->off, NULL, 0);
+	r->unacked = 0;
+}
+
+/* Without progress for XFER_RTO the sender repeats its offer, for up to
+   XFER_OFFER_TRIES to give the receiver time to accept, or goes back to
+   the last acknowledged offset. Receivers acknowledge what is left
+   unacknowledged, and forget transfers and offers that went quiet, an
+   unfinished transfer resumes from its part file. The GUI thread only
+   opens and accepts transfers, all frames are sent from here and from
+   the handlers on the net thread. */
+static void pvl_xfer_timers(u64 now)
+{
+	char ipb[IPV4_STRBUF];
+	for(size_t i = 0; i < xfers.num_send; ++i)
+	{
+		XferSend *s = xfers.send + i;
+		if(now < s->due)
+		{
+			continue;
+		}
+
+		if(++s->tries > (s->started ? XFER_MAX_TRIES : XFER_OFFER_TRIES))
+		{
+			term_print(&logger, TAG_LOG, "Sending %s to %s failed at %u of %u bytes",
+				s->name, ip_to_str(ipb, s->dst), s->acked, s->size);
+			xfer_send_close(&xfers, s);
+			--i;
+			continue;
+		}
+
+		s->due = now + XFER_RTO;
+		if(!s->started)
+		{
+			pvl_xfer_offer(s);
+			continue;
+		}
+
+		s->next = s->acked;
+		pvl_xfer_pump(s);
+	}
+
+	for(size_t i = 0; i < xfers.num_recv; ++i)
+	{
+		XferRecv *r = xfers.recv + i;
+		if(now - r->seen > (u64)XFER_RTO * XFER_MAX_TRIES)
+		{
+			xfer_recv_close(&xfers, r);
+			--i;
+		}
+		else if(r->accepted && r->unacked)
+		{
+			pvl_xfer_ack(r);
+		}
+	}
+}
+
+static void pvl_handle_file(const u8 *buf, u64 now)
+{
+	char ipb[IPV4_STRBUF];
+	ip_addr src = pvl_get_src(buf);
+	u32 id = pvl_get_msgid(buf);
+	u32 off = pvl_get_file_off(buf);
+	size_t len = pvl_get_length(buf);
+	XferSend *s;
+	XferRecv *r;
+	ip_to_str(ipb, src);
+	switch(pvl_get_msgtype(buf))
+	{
+	case PVL_FILE_OFFER:
+		if(len < PVL_FILE_SUM_SIZE)
+		{
+			return;
+		}
+
+		if(!(r = xfer_recv_find(&xfers, src, id)))
+		{
+			char name[XFER_NAME];
+			snprintf(name, sizeof(name), "%.*s",
+				(int)(len - PVL_FILE_SUM_SIZE), pvl_get_file_name(buf));
+			if(!(r = xfer_recv_offer(&xfers, src, id, name, off,
+				pvl_get_file_sum(buf))))
+			{
+				term_print(&logger, TAG_LOG, "Can't receive %s from %s", name, ipb);
+				return;
+			}
+
+			term_print(&logger, TAG_LOG, "%s offers %s (%u bytes), "
+				"/accept %u to receive it", ipb, r->name, r->size, r->num);
+		}
+
+		/* The offer is repeated until it is accepted */
+		r->seen = now;
+		if(r->accepted)
+		{
+			pvl_xfer_ack(r);
+		}
+		break;
+
+	case PVL_FILE_CHUNK:
+		if(!(r = xfer_recv_find(&xfers, src, id)) || !r->accepted)
+		{
+			return;
+		}
+
+		r->seen = now;
+		if(xfer_recv_write(r, off, pvl_get_file_data(buf), len))
+		{
+			pvl_xfer_ack(r);
+		}
+		else if(r->off == r->size)
+		{
+			switch(xfer_recv_finish(r, XFER_DIR))
+			{
+			case XFER_SAVED:
+				term_print(&logger, TAG_LOG, "Received %s from %s", r->name, ipb);
+				break;
+
+			case XFER_CORRUPT:
+				term_print(&logger, TAG_LOG, "%s from %s failed its checksum",
+					r->name, ipb);
+				break;
+
+			default:
+				term_print(&logger, TAG_LOG, "Can't save %s from %s", r->name, ipb);
+				break;
+			}
+
+			pvl_xfer_ack(r);
+		}
+		else if(++r->unacked >= XFER_ACK_EVERY)
+		{
+			pvl_xfer_ack(r);
+		}
+		break;
+
+	case PVL_FILE_ACK:
+		if(!(s = xfer_send_find(&xfers, src, id)) || !xfer_send_ack(s, off, now))
+		{
+			return;
+		}
+
+		if(s->acked == s->size)
+		{
+			term_print(&logger, TAG_LOG, "Sent %s to %s", s->name, ipb);
+			xfer_send_close(&xfers, s);
+			return;
+		}
+
+		pvl_xfer_pump(s);
+		break;
+	}
+}
+
+void net_tick(void)
+{
+	static u64 next_rotate;
+	u64 now = time_us();
+	pvl_apply_cmds();
+
+	if(now >= next_rotate)
+	{
+		next_rotate = now + DEDUP_INTERVAL * 1000;
+		dedup_rotate(&dedup);
+		dedup_rotate(&mcast_seen);
+	}
+
+	if(ls_mode)
+	{
+		ls_timers(now);
+	}
+	else
+	{
+		pvl_rt_timers(now);
+	}
+
+	outbox_timers(&outbox, now);
+	pthread_mutex_lock(&xfer_lock);
+	pvl_xfer_timers(now);
+	pthread_mutex_unlock(&xfer_lock);
+	pvl_ack_timers(now);
+	spool_due = 0;
+	outbox_flush(&outbox);
+
+	for(size_t i = 0; i < links.len; ++i)
+	{
+		Link *link = links.links + i;
+		pvl_stream_rt(link);
+		if(now >= link->ping_due)
+		{
+			link->ping_due = now + LINK_PING_INTERVAL * 1000;
+			pvl_send_ping(link->addr);
+		}
+	}
+}
+
+/* Called for frames the net layer gave up on because the queue towards
+   ip was full or kept a standing delay. The source of a message learns
+   about it through a NACK. */
+void net_dropped(ip_addr ip, const u8 *buf, size_t len)
+{
+	char ipb[IPV4_STRBUF];
+	ip_addr src;
+	u32 msgid;
+	if(len < PVL_HEADER_SIZE + PVL_MSG_HEADER_SIZE ||
+		pvl_get_msgtype(buf) != PVL_MESSAGE)
+	{
+		return;
+	}
+
+	src = pvl_get_src(buf);
+	msgid = pvl_get_msgid(buf);
+	term_print(&logger, TAG_LOG, "Queue to %s congested, dropped message",
+		ip_to_str(ipb, ip));
+	if(src != my_ip)
+	{
+		pvl_send_nack(src, msgid, NACK_CONGESTED);
+	}
+}
+
+/* Admission control for frames that are relayed. Both the bucket of the
+   neighbour and that of the source only count relayed traffic, frames
+   addressed to us are never limited. Runs before the frame is copied or
+   its CRC is computed, so traffic over the limit of its neighbour or its
+   source costs next to nothing. */
+static int pvl_admit(ip_addr ip, const u8 *buf, size_t total_len)
+{
+	u32 msgtype = pvl_get_msgtype(buf);
+	u64 now;
+	if(msgtype != PVL_MESSAGE && msgtype != PVL_ACK &&
+		msgtype != PVL_NACK && msgtype != PVL_SACK &&
+		msgtype != PVL_MULTICAST && msgtype != PVL_FILE_OFFER &&
+		msgtype != PVL_FILE_CHUNK && msgtype != PVL_FILE_ACK)
+	{
+		return 1;
+	}
+
+	if(total_len < PVL_OFFSET_SRC + 4 || pvl_get_dst(buf) == my_ip)
+	{
+		return 1;
+	}
+
+	now = time_us();
+	if(!ratetab_take(&rl_link, ip, total_len, now))
+	{
+		++stats.rl_link_drops;
+		return 0;
+	}
+
+	if(!ratetab_take(&rl_src, pvl_get_src(buf), total_len, now))
+	{
+		++stats.rl_src_drops;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Returns the frame with its payload inflated, in a buffer of the net
+   thread that is valid until the next call, NULL if it is corrupt */
+static const u8 *pvl_inflate(const u8 *buf)
+{
+	static u8 plain[PVL_HEADER_SIZE + PVL_SACK_HEADER_SIZE + LZ_MAX_INPUT];
+	size_t len = pvl_get_length(buf);
+	size_t head = pvl_total_len(buf) - len;
+	size_t plain_len;
+	if(len < 2)
+	{
+		return NULL;
+	}
+
+	plain_len = (buf[head] << 8) | buf[head + 1];
+	if(lz_decompress(buf + head + 2, len - 2, plain + head, plain_len) !=
+		(ssize_t)plain_len)
 	{
-		term_print(&logger, TAG_LOG, "TTL expired");
-		pvl_send_nack(src, pvl_get_msgid(buf), NACK_TTL);
+		return NULL;
 	}
 
-	u8 *msg = smalloc(len);
-	memcpy(msg, buf, len);
-	pvl_set_ttl(msg, ttl);
-	pvl_set_crc(msg, pvl_calc_crc(msg));
-	net_send(net, via, msg, len);
+	memcpy(plain, buf, head);
+	pvl_clear_flags(plain, PVL_FLAG_LZ);
+	pvl_set_length(plain, plain_len);
+	pvl_set_crc(plain, pvl_calc_crc(plain));
+	return plain;
 }
 
 static ssize_t pvl_read_msg(ip_addr ip, const u8 *buf, size_t len)
@@ -437,15 +1838,29 @@ static ssize_t pvl_read_msg(ip_addr ip, const u8 *buf, size_t len)
 
 	printf("total_len = %d\n", (int)total_len);
 
+	++stats.rx_frames;
+	stats.rx_bytes += total_len;
+	if(!pvl_admit(ip, buf, total_len))
+	{
+		return total_len;
+	}
+
 	u32 recv_crc = pvl_get_crc(buf);
 	u32 calc_crc = pvl_calc_crc(buf);
 	if(recv_crc != calc_crc)
 	{
+		++stats.crc_errors;
 		term_print(&logger, TAG_LOG, "Received CRC %08X != calculated %08X, closing connection with %s",
 			recv_crc, calc_crc, ipb);
 		/* return -1; */
 	}
 
+	if((pvl_get_flags(buf) & PVL_FLAG_LZ) && !(buf = pvl_inflate(buf)))
+	{
+		term_print(&logger, TAG_LOG, "Received corrupt compressed frame from %s", ipb);
+		return total_len;
+	}
+
 	pvl_print_header(buf);
 	switch(msgtype)
 	{
@@ -464,8 +1879,24 @@ static ssize_t pvl_read_msg(ip_addr ip, const u8 *buf, size_t len)
 
 			if(dst == my_ip)
 			{
-				pvl_print_msg(src, pvl_get_length(buf), pvl_get_msg_data(buf));
-				pvl_send_ack(src, pvl_get_msgid(buf));
+				u64 now = time_us();
+				if(pvl_ack_msg(src, pvl_get_msgid(buf),
+					pvl_get_flags(buf) & PVL_FLAG_CE, now))
+				{
+					++stats.delivered;
+					pvl_deliver(src, pvl_get_msgid(buf), pvl_get_length(buf),
+						pvl_get_msg_data(buf), now);
+				}
+				else
+				{
+					++stats.duplicates;
+				}
+			}
+			else if(dedup_seen(&dedup, src, pvl_get_msgid(buf)))
+			{
+				/* A copy of this message passed shortly before, on a
+				   loop or a second path while routes converge */
+				++stats.duplicates;
 			}
 			else
 			{
@@ -478,6 +1909,10 @@ static ssize_t pvl_read_msg(ip_addr ip, const u8 *buf, size_t len)
 		pvl_handle_rt(ip, buf);
 		break;
 
+	case PVL_ROUTING_PART:
+		pvl_handle_rt_part(ip, buf);
+		break;
+
 	case PVL_ACK:
 		{
 			ip_addr dst = pvl_get_dst(buf);
@@ -485,7 +1920,24 @@ static ssize_t pvl_read_msg(ip_addr ip, const u8 *buf, size_t len)
 			u32 msgid = pvl_get_msgid(buf);
 			if(dst == my_ip)
 			{
-				pvl_print_ack(src, msgid, TAG_ACK);
+				outbox_ack(&outbox, src, msgid, time_us());
+			}
+			else
+			{
+				pvl_forward(buf);
+			}
+		}
+		break;
+
+	case PVL_SACK:
+		{
+			ip_addr dst = pvl_get_dst(buf);
+			ip_addr src = pvl_get_src(buf);
+			if(dst == my_ip)
+			{
+				outbox_sack(&outbox, src, pvl_get_msgid(buf),
+					pvl_get_sack_map(buf),
+					pvl_get_flags(buf) & PVL_FLAG_CE, time_us());
 			}
 			else
 			{
@@ -499,9 +1951,22 @@ static ssize_t pvl_read_msg(ip_addr ip, const u8 *buf, size_t len)
 			ip_addr dst = pvl_get_dst(buf);
 			ip_addr src = pvl_get_src(buf);
 			u32 msgid = pvl_get_msgid(buf);
+			u32 status = pvl_get_nack_status(buf);
 			if(dst == my_ip)
 			{
-				pvl_print_ack(src, msgid, TAG_NACK);
+				/* Congestion and corruption are transient, the message
+				   is retransmitted when its timeout expires */
+				char srcb[IPV4_STRBUF];
+				term_print(&logger, TAG_LOG, "NACK %u from %s for message %u",
+					status, ip_to_str(srcb, src), msgid);
+				if(status == NACK_CONGESTED)
+				{
+					outbox_congested(&outbox, msgid);
+				}
+				else if(status != NACK_CRC)
+				{
+					outbox_fail(&outbox, msgid);
+				}
 			}
 			else
 			{
@@ -510,17 +1975,48 @@ static ssize_t pvl_read_msg(ip_addr ip, const u8 *buf, size_t len)
 		}
 		break;
 
+	case PVL_MULTICAST:
+		pvl_handle_mcast(buf);
+		break;
+
+	case PVL_FILE_OFFER:
+	case PVL_FILE_CHUNK:
+	case PVL_FILE_ACK:
+		if(pvl_get_dst(buf) == my_ip)
+		{
+			pthread_mutex_lock(&xfer_lock);
+			pvl_handle_file(buf, time_us());
+			pthread_mutex_unlock(&xfer_lock);
+		}
+		else
+		{
+			pvl_forward(buf);
+		}
+		break;
+
 	case PVL_PING:
+		pvl_handle_features(ip, buf);
 		pvl_send_pong(ip);
 		break;
+
+	case PVL_PONG:
+		pvl_handle_features(ip, buf);
+		pvl_handle_pong(ip);
+		break;
+
+	case PVL_LSA:
+		pvl_handle_lsa(ip, buf);
+		break;
 	}
 
 	return total_len;
 }
 
-ssize_t net_received(ip_addr ip, const u8 *buf, size_t len)
+ssize_t net_received(ip_addr ip, NetHandle handle,
+	const u8 *buf, size_t len)
 {
 	printf("net received: %zu bytes\n", len);
+	pvl_update_conn(ip, handle);
 
 	ssize_t bytes = 0;
 	ssize_t result;
@@ -535,6 +2031,12 @@ ssize_t net_received(ip_addr ip, const u8 *buf, size_t len)
 		bytes += result;
 	}
 	while(result > 0);
+	if(spool_due)
+	{
+		spool_due = 0;
+		outbox_flush(&outbox);
+	}
+
 	gfx_notify();
 	return bytes;
 }
@@ -601,12 +2103,30 @@ void btn_member_clicked(Element *e)
 {
 	Button *b = (Button *)e;
 	cur_partner = b->Tag;
-	Route *r = rt_find(&rt, cur_partner);
+	Group *g = group_find(cur_partner);
+	if(g)
+	{
+		mode = MODE_CHAT;
+		sprintf(lbl_view.Text, "View: group %s - %zu members",
+			getalias(g->id), g->num_members);
+		btn_disconnect.Flags |= FLAG_INVISIBLE;
+		setname_show();
+		return;
+	}
+
+	Route route, *r = &route;
+	size_t idx = rt_find(&rt, cur_partner);
+	if(idx == RT_NONE)
+	{
+		return;
+	}
+
+	rt_get(&rt, idx, r);
 	mode = MODE_CHAT;
 
 	char namebuf[64];
 	getnamebuf(namebuf, sizeof(namebuf), r->dst);
-	if(r->hops == 1)
+	if(r->via[0] == r->dst)
 	{
 		sprintf(lbl_view.Text, "View: %s - direct", namebuf);
 		btn_disconnect.Flags &= ~FLAG_INVISIBLE;
@@ -614,9 +2134,9 @@ void btn_member_clicked(Element *e)
 	else
 	{
 		char vianb[64];
-		getnamebuf(vianb, sizeof(vianb), r->via);
-		sprintf(lbl_view.Text, "View: %s via %s - %d Hops",
-			namebuf, vianb, r->hops);
+		getnamebuf(vianb, sizeof(vianb), r->via[0]);
+		sprintf(lbl_view.Text, "View: %s via %s - %d Hops, Cost %d",
+			namebuf, vianb, r->hops, r->cost);
 		btn_disconnect.Flags |= FLAG_INVISIBLE;
 	}
 
@@ -639,31 +2159,35 @@ void btn_disconnect_clicked(Element *e)
 
 static void table_sep(int x, int *y)
 {
-	font_string(x, *y, "+-----+-----------------+-----------------+------+", 0, 0);
+	font_string(x, *y, "+-----+--------------------+-----------------+-------+------+--------+", 0, 0);
 	*y += TABLE_H;
 }
 
 static void routes_draw(void)
 {
 	char buf[128];
-	char dst_buf[IPV4_STRBUF], via_buf[IPV4_STRBUF];
+	char dst_buf[IPV4_STRBUF + 3], via_buf[IPV4_STRBUF];
 
 	int x = SIDEBAR_W + 2 * PADDING;
 	int y = 2 * INPUT_HEIGHT + FONT_HEIGHT + 4 * PADDING;
 
 	table_sep(x, &y);
-	font_string(x, y, "| No. | Destination     | Via             | Hops |", 0, 0);
+	font_string(x, y, "| No. | Destination        | Via             | Paths | Hops |   Cost |", 0, 0);
 	y += TABLE_H;
 	table_sep(x, &y);
 
 	for(size_t i = 0; i < rt.len; ++i)
 	{
+		size_t len = strlen(ip_to_str(dst_buf, rt.dst[i]));
+		sprintf(dst_buf + len, "/%d", rt.plen[i]);
 		snprintf(buf, sizeof(buf),
-			"| %3zu | %15s | %15s | %4d |",
+			"| %3zu | %18s | %15s | %5d | %4d | %6d |",
 			i,
-			ip_to_str(dst_buf, rt.routes[i].dst),
-			ip_to_str(via_buf, rt.routes[i].via),
-			rt.routes[i].hops);
+			dst_buf,
+			ip_to_str(via_buf, rt.via[0][i]),
+			rt.num_via[i],
+			rt.hops[i],
+			rt.cost[i]);
 
 		font_string(x, y, buf, 0, 0);
 		y += TABLE_H;
@@ -671,9 +2195,367 @@ static void routes_draw(void)
 	}
 }
 
+static void cmd_cost(const char *args)
+{
+	char ipb[IPV4_STRBUF], costb[16];
+	ip_addr ip;
+	size_t i;
+	if(sscanf(args, "%15s %15s", ipb, costb) != 2)
+	{
+		term_print(&logger, TAG_LOG, "Usage: /cost <ip> <cost|auto>");
+		return;
+	}
+
+	/* The net thread checks the neighbour and reports the new cost */
+	ip = str_to_ip(ipb);
+	pthread_mutex_lock(&cmd_lock);
+	for(i = 0; i < num_cost_new; ++i)
+	{
+		if(cost_new[i].ip == ip)
+		{
+			break;
+		}
+	}
+
+	if(i < MAXCLIENTS)
+	{
+		cost_new[i].ip = ip;
+		cost_new[i].cost = strcmp(costb, "auto") ?
+			strtoul(costb, NULL, 10) : 0;
+		num_cost_new += i == num_cost_new;
+	}
+
+	pthread_mutex_unlock(&cmd_lock);
+	if(i == MAXCLIENTS)
+	{
+		term_print(&logger, TAG_LOG, "Too many cost changes, try again");
+	}
+}
+
+static void cmd_linkstate(const char *args)
+{
+	/* The switch floods the whole table, the net thread makes it */
+	if(!strcmp(args, "on") || !strcmp(args, "off"))
+	{
+		pthread_mutex_lock(&cmd_lock);
+		ls_mode_new = !strcmp(args, "on");
+		pthread_mutex_unlock(&cmd_lock);
+		return;
+	}
+
+	term_print(&logger, TAG_LOG, "Routing mode: %s",
+		ls_mode ? "link-state" : "distance-vector");
+}
+
+static void cmd_backlog(const char *args)
+{
+	int backlog = atoi(args);
+	if(backlog <= 0)
+	{
+		term_print(&logger, TAG_LOG, "Usage: /backlog <connections>");
+		return;
+	}
+
+	net_set_backlog(net, backlog);
+}
+
+static void cmd_busypoll(const char *args)
+{
+	if(!strcmp(args, "off"))
+	{
+		net_set_busy_poll(net, 0);
+	}
+	else if(atoi(args) > 0)
+	{
+		net_set_busy_poll(net, atoi(args));
+	}
+	else
+	{
+		term_print(&logger, TAG_LOG, "Usage: /busypoll <us|off>");
+	}
+}
+
+static void cmd_stats(void)
+{
+	term_print(&logger, TAG_LOG, "Received %llu frames, %llu bytes",
+		(unsigned long long)stats.rx_frames,
+		(unsigned long long)stats.rx_bytes);
+	term_print(&logger, TAG_LOG, "Forwarded %llu frames, %llu CRC errors",
+		(unsigned long long)stats.forwarded,
+		(unsigned long long)stats.crc_errors);
+	term_print(&logger, TAG_LOG,
+		"Rate limited: %llu by source, %llu by neighbour",
+		(unsigned long long)stats.rl_src_drops,
+		(unsigned long long)stats.rl_link_drops);
+	term_print(&logger, TAG_LOG,
+		"Suppressed %llu duplicate messages, marked %llu congested",
+		(unsigned long long)stats.duplicates,
+		(unsigned long long)stats.ce_marks);
+	term_print(&logger, TAG_LOG, "Compressed %llu bytes to %llu",
+		(unsigned long long)stats.lz_in,
+		(unsigned long long)stats.lz_out);
+	term_print(&logger, TAG_LOG,
+		"Delivered %llu messages, sent %llu ACKs (%.2f per message)",
+		(unsigned long long)stats.delivered,
+		(unsigned long long)stats.acks_sent,
+		stats.delivered ? (double)stats.acks_sent / stats.delivered : 0.0);
+}
+
+static void cmd_ratelimit(const char *args)
+{
+	char which[8];
+	unsigned rate, burst;
+	if(sscanf(args, "%7s %u %u", which, &rate, &burst) != 3 ||
+		(strcmp(which, "src") && strcmp(which, "link")))
+	{
+		term_print(&logger, TAG_LOG,
+			"Usage: /ratelimit <src|link> <bytes/s> <burst>");
+		return;
+	}
+
+	RateChange *c = strcmp(which, "src") ? &rl_link_new : &rl_src_new;
+	pthread_mutex_lock(&cmd_lock);
+	c->pending = 1;
+	c->rate = rate;
+	c->burst = burst;
+	pthread_mutex_unlock(&cmd_lock);
+	term_print(&logger, TAG_LOG, "Rate limit per %s: %u B/s, burst %u B",
+		which, rate, burst);
+}
+
+/* Members are given by address or alias */
+static void cmd_group(const char *args)
+{
+	char name[60], member[60];
+	Group *g;
+	ip_addr id = 2166136261u;
+	int n;
+	if(sscanf(args, "%59s%n", name, &n) != 1)
+	{
+		term_print(&logger, TAG_LOG, "Usage: /group <name> <member>...");
+		return;
+	}
+
+	for(const char *c = name; *c; ++c)
+	{
+		id = (id ^ (u8)*c) * 16777619u;
+	}
+
+	id = 0xEF000000 | (id & 0xFFFFFF);
+	if(!(g = group_find(id)))
+	{
+		if(numgroups >= MAXGROUPS || numnames >= MAXROUTES)
+		{
+			term_print(&logger, TAG_LOG, "Too many groups");
+			return;
+		}
+
+		g = groups + numgroups++;
+		g->id = id;
+		addalias(id, name);
+	}
+
+	g->num_members = 0;
+	for(args += n; sscanf(args, "%59s%n", member, &n) == 1; args += n)
+	{
+		ip_addr ip = alias_find(member);
+		if(!ip && (ip = str_to_ip(member)) == 0xFFFFFFFF)
+		{
+			term_print(&logger, TAG_LOG, "Unknown member %s", member);
+			continue;
+		}
+
+		if(g->num_members < PVL_MCAST_MAX && ip != my_ip && !group_find(ip))
+		{
+			g->members[g->num_members++] = ip;
+		}
+	}
+
+	term_print(&logger, TAG_LOG, "Group %s has %zu members",
+		name, g->num_members);
+	update_gui_routes();
+}
+
+/* Offers a file to the current chat partner on the next tick, the
+   transfer starts once the offer is acknowledged */
+static void cmd_send(const char *path)
+{
+	XferSend *s;
+	if(!cur_partner || group_find(cur_partner))
+	{
+		term_print(&logger, TAG_LOG, "Select a host to send a file to");
+		return;
+	}
+
+	pthread_mutex_lock(&xfer_lock);
+	if((s = xfer_send_open(&xfers, cur_partner, ++xfer_seq, path)))
+	{
+		term_print(&logger, TAG_LOG, "Offering %s (%u bytes)", s->name, s->size);
+	}
+	else
+	{
+		term_print(&logger, TAG_LOG, "Can't send %s", path);
+	}
+
+	pthread_mutex_unlock(&xfer_lock);
+}
+
+static void cmd_accept(const char *args)
+{
+	char ipb[IPV4_STRBUF];
+	XferRecv *r;
+	pthread_mutex_lock(&xfer_lock);
+	if(!(r = xfer_recv_find_num(&xfers, strtoul(args, NULL, 10))) ||
+		r->accepted)
+	{
+		term_print(&logger, TAG_LOG, "No such offer");
+	}
+	else if(xfer_recv_accept(r, XFER_DIR))
+	{
+		term_print(&logger, TAG_LOG, "Can't receive %s", r->name);
+	}
+	else
+	{
+		term_print(&logger, TAG_LOG, "Receiving %s (%u bytes) from %s at %u",
+			r->name, r->size, ip_to_str(ipb, r->src), r->off);
+		/* Acknowledged on the next tick, which starts the transfer */
+		r->unacked = 1;
+	}
+
+	pthread_mutex_unlock(&xfer_lock);
+}
+
+/* Compression ratio and speed on the chat lines in the terminals, each
+   line taken as one message */
+static void cmd_lzbench(void)
+{
+	static u8 packed[2 * BUFSIZE], plain[2 * BUFSIZE];
+	u64 in = 0, out = 0, t_comp = 0, t_decomp = 0;
+	u32 rounds = 0;
+	u64 start = time_us();
+	while(time_us() - start < 200000 || !rounds)
+	{
+		++rounds;
+		for(size_t i = 0; i < numnames; ++i)
+		{
+			Terminal *term = &names[i].term;
+			for(size_t j = 0; j < term->num_lines; ++j)
+			{
+				TLine *line = term_line(term, j);
+				size_t n;
+				u64 t0, t1;
+				if(!line || line->len > BUFSIZE)
+				{
+					break;
+				}
+
+				t0 = time_us();
+				n = lz_compress((const u8 *)line->text, line->len,
+					packed, sizeof(packed));
+				t1 = time_us();
+				lz_decompress(packed, n, plain, sizeof(plain));
+				t_decomp += time_us() - t1;
+				t_comp += t1 - t0;
+				in += line->len;
+				out += n;
+			}
+		}
+
+		if(!in)
+		{
+			term_print(&logger, TAG_LOG, "No chat lines to compress");
+			return;
+		}
+	}
+
+	term_print(&logger, TAG_LOG, "%u rounds: %llu -> %llu bytes, ratio %.2f",
+		rounds, (unsigned long long)in, (unsigned long long)out,
+		(double)in / out);
+	term_print(&logger, TAG_LOG, "Compress %.1f MB/s, decompress %.1f MB/s",
+		t_comp ? (double)in / t_comp : 0.0,
+		t_decomp ? (double)in / t_decomp : 0.0);
+}
+
 static int handle_command(const char *s)
 {
+	static const char cmd_ratelimit_str[] = "/ratelimit ";
+	static const char cmd_stats_str[] = "/stats";
+	static const char cmd_busypoll_str[] = "/busypoll ";
+	static const char cmd_wakeup[] = "/wakeup";
+	static const char cmd_backlog_str[] = "/backlog ";
+	static const char cmd_linkstate_str[] = "/linkstate ";
+	static const char cmd_cost_str[] = "/cost ";
+	static const char cmd_group_str[] = "/group ";
+	static const char cmd_send_str[] = "/send ";
+	static const char cmd_accept_str[] = "/accept ";
+	static const char cmd_lzbench_str[] = "/lzbench";
 	static const char cmd_clear[] = "/clear";
+	if(!strncmp(s, cmd_cost_str, sizeof(cmd_cost_str) - 1))
+	{
+		cmd_cost(s + sizeof(cmd_cost_str) - 1);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_ratelimit_str, sizeof(cmd_ratelimit_str) - 1))
+	{
+		cmd_ratelimit(s + sizeof(cmd_ratelimit_str) - 1);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_stats_str, sizeof(cmd_stats_str)))
+	{
+		cmd_stats();
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_busypoll_str, sizeof(cmd_busypoll_str) - 1))
+	{
+		cmd_busypoll(s + sizeof(cmd_busypoll_str) - 1);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_wakeup, sizeof(cmd_wakeup)))
+	{
+		net_report_wakeup(net);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_backlog_str, sizeof(cmd_backlog_str) - 1))
+	{
+		cmd_backlog(s + sizeof(cmd_backlog_str) - 1);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_linkstate_str, sizeof(cmd_linkstate_str) - 1))
+	{
+		cmd_linkstate(s + sizeof(cmd_linkstate_str) - 1);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_lzbench_str, sizeof(cmd_lzbench_str)))
+	{
+		cmd_lzbench();
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_send_str, sizeof(cmd_send_str) - 1))
+	{
+		cmd_send(s + sizeof(cmd_send_str) - 1);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_accept_str, sizeof(cmd_accept_str) - 1))
+	{
+		cmd_accept(s + sizeof(cmd_accept_str) - 1);
+		return 1;
+	}
+
+	if(!strncmp(s, cmd_group_str, sizeof(cmd_group_str) - 1))
+	{
+		cmd_group(s + sizeof(cmd_group_str) - 1);
+		return 1;
+	}
+
 	if(!strncmp(s, cmd_clear, sizeof(cmd_clear)))
 	{
 		if(mode == MODE_LOGGER)
@@ -723,8 +2605,41 @@ static void msg_send_to(void)
 
 	pos = append(msgbuf, pos, fld_msg.Text, fld_msg.Length);
 	msgbuf[pos] = '\0';
-	pvl_send_msg(cur_partner, msgbuf, pos);
-	pvl_print_my_msg(cur_partner, msg_id - 1, fld_msg.Length, fld_msg.Text);
+
+	Group *g = group_find(cur_partner);
+	if(g)
+	{
+		if(pvl_send_mcast(g, msgbuf, pos))
+		{
+			term_print(&logger, TAG_LOG, "Message too long for %zu members",
+				g->num_members);
+			return;
+		}
+
+		pvl_print_my_msg(cur_partner, TAG_LOG, fld_msg.Length, fld_msg.Text);
+		return;
+	}
+
+	/* Holding the lock keeps the ACK from arriving before the line it
+	   marks is printed */
+	outbox_lock(&outbox);
+	u32 handle = outbox_send(&outbox, cur_partner, msgbuf, pos,
+		pvl_tx_done, NULL);
+	if(!handle)
+	{
+		term_print(&logger, TAG_LOG, "Too many unsent messages, spool full");
+	}
+	else
+	{
+		pvl_print_my_msg(cur_partner, handle, fld_msg.Length, fld_msg.Text);
+	}
+
+	outbox_unlock(&outbox);
+	if(handle)
+	{
+		/* The net thread moves it into the send window if it has a route */
+		net_post(net, cur_partner, NULL, 0);
+	}
 }
 
 void btn_send_clicked(Element *e)
@@ -768,7 +2683,6 @@ int main(void)
 	crc_test();
 #endif
 
-	msg_id = 0xFF;
 	my_ip = getip();
 	if(!my_ip)
 	{
@@ -776,8 +2690,17 @@ int main(void)
 		return 1;
 	}
 
-	rt_init(&rt_prev, MAXCLIENTS);
-	rt_init(&rt, MAXCLIENTS);
+	rt_init(&rt_prev, MAXROUTES);
+	rt_init(&rt, MAXROUTES);
+	links_init(&links, MAXCLIENTS);
+	ratetab_init(&rl_src, RATE_SOURCES, RATE_SRC, RATE_SRC_BURST);
+	ratetab_init(&rl_link, 2 * MAXCLIENTS, RATE_LINK, RATE_LINK_BURST);
+	rxtab_init(&rxtab, MAXROUTES);
+	dedup_clear(&dedup);
+	dedup_clear(&mcast_seen);
+	mcast_seq = time_us() ^ ~my_ip;
+	xfer_seq = time_us() ^ my_ip;
+	lsdb_init(&lsdb, MAXROUTES, my_ip);
 
 	int running = 1;
 	gfx_init();
@@ -787,12 +2710,21 @@ int main(void)
 
 	char mipb[IPV4_STRBUF];
 	term_print(&logger, TAG_LOG, "My IP: %s", ip_to_str(mipb, my_ip));
-
 	char buf[64];
+	snprintf(buf, sizeof(buf), SPOOL_FILE, mipb);
+	outbox_init(&outbox, my_ip, MAXROUTES, buf, pvl_tx_send, pvl_routed);
+
 	snprintf(buf, sizeof(buf), "RN Chatapp (%s)", mipb);
 	gfx_set_title(buf);
 
-	if(!(net = net_start(MAXCLIENTS, BUFSIZE, PORT)))
+	NetConfig cfg =
+	{
+		MAXCLIENTS, BUFSIZE, SENDBUFSIZE, PORT,
+		BACKLOG, ACCEPTBUDGET, READQUANTUM,
+		BUSYPOLL_US, NET_CPU
+	};
+
+	if(!(net = net_start(&cfg)))
 	{
 		return 1;
 	}
@@ -876,6 +2808,7 @@ int main(void)
 	}
 
 	net_quit(net);
+	outbox_free(&outbox);
 	term_free(&logger);
 	for(size_t i = 0; i < numnames; ++i)
 	{
@@ -886,6 +2819,19 @@ int main(void)
 	gfx_destroy();
 	rt_free(&rt);
 	rt_free(&rt_prev);
+	links_free(&links);
+	lsdb_free(&lsdb);
+	while(xfers.num_send)
+	{
+		xfer_send_close(&xfers, xfers.send);
+	}
+
+	while(xfers.num_recv)
+	{
+		xfer_recv_close(&xfers, xfers.recv);
+	}
+
+	rxtab_free(&rxtab);
 	print_allocs();
 	return 0;
 }
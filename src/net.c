@@ -1,15 +1,21 @@
 #define _GNU_SOURCE
 #include "net.h"
+#include "netq.h"
+#include "codel.h"
 #include "util.h"
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <poll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -20,17 +26,31 @@
 #define CMD_FD             0
 #define SERVER_FD          1
 #define OFFSET_FD          2
-#define ACCEPT_QUEUE_SIZE  5
-
+#define NET_TICK_MS      100
+#define NET_SLOT_MASK    ((1u << NET_SLOT_BITS) - 1)
+#define NET_GEN_MASK     (0xFFFFFFFFu >> NET_SLOT_BITS)
+#define WAKEUP_BUCKETS    20
+#define NET_QUEUE_FRAMES 1024
+#define NET_IOV_MAX        32
+#define NET_NOTSENT_LOWAT  (16 * 1024)
+
+/* Outgoing frames wait in one queue per send class. The frame being
+   written is taken out of its queue into cur, so that a class switch only
+   ever happens between frames. */
 typedef struct
 {
 	u8 *buf;
-	u8 *sbuf;
 	size_t cap;
+	size_t scap;
 	size_t wp;
-	size_t rp;
+	NetQueue sq[NET_PRIOS];
+	Codel codel;
+	NetFrame cur;
+	size_t cur_off;
+	size_t deficit;
 	ip_addr addr;
 	u32 connected;
+	u32 gen;
 } Client;
 
 struct Net
@@ -38,26 +58,44 @@ struct Net
 	int qfds[2];
 	int sfd;
 	int started;
-	size_t num_clients, max_clients, bufsiz;
+	size_t num_slots, max_clients, bufsiz, sbufsiz;
+	size_t num_free;
+	int backlog;
+	u32 accept_budget;
+	u32 read_quantum;
+	u32 busy_poll_us;
+	int cpu;
+	size_t rr_next;
+	u64 wakeup_hist[WAKEUP_BUCKETS];
+	u64 wakeup_max;
 	pthread_t thread;
 	Client *clients;
+	u32 *free_slots;
 	struct pollfd *fds, *cfds;
+	u64 last_tick;
 	u16 port;
 };
 
 typedef struct
 {
 	u32 type;
+	NetHandle handle;
 	ip_addr dst;
+	u32 prio;
 	void *buf;
 	size_t len;
+	u64 queued;
 } NetCmd;
 
 enum
 {
 	NET_CMD_CONNECT,
 	NET_CMD_SEND,
-	NET_CMD_DISCONNECT
+	NET_CMD_DISCONNECT,
+	NET_CMD_BACKLOG,
+	NET_CMD_BUSY_POLL,
+	NET_CMD_WAKEUP,
+	NET_CMD_POST
 };
 
 static void pollfd_start_writing(struct pollfd *pfd)
@@ -90,22 +128,57 @@ static void sockaddr_init(struct sockaddr_in *addr, ip_addr ip, uint16_t port)
 	addr->sin_addr.s_addr = htonl(ip);
 }
 
-static void client_init(Client *client, size_t cap, struct sockaddr_in *cliaddr,
-	int conn)
+static void client_init(Client *client, size_t cap, size_t scap,
+	struct sockaddr_in *cliaddr, int conn)
 {
 	client->cap = cap;
+	client->scap = scap;
 	client->buf = smalloc(cap);
-	client->sbuf = smalloc(cap);
+	for(u32 p = 0; p < NET_PRIOS; ++p)
+	{
+		netq_init(client->sq + p, NET_QUEUE_FRAMES);
+	}
+
+	codel_init(&client->codel);
+	client->cur.buf = NULL;
+	client->cur_off = 0;
 	client->connected = conn;
-	client->rp = 0;
 	client->wp = 0;
+	client->deficit = 0;
 	client->addr = sockaddr_to_uint(cliaddr);
 }
 
 static void client_free(Client *client)
 {
 	sfree(client->buf);
-	sfree(client->sbuf);
+	sfree(client->cur.buf);
+	for(u32 p = 0; p < NET_PRIOS; ++p)
+	{
+		netq_free(client->sq + p);
+	}
+}
+
+static int client_pending(Client *client)
+{
+	if(client->cur.buf)
+	{
+		return 1;
+	}
+
+	for(u32 p = 0; p < NET_PRIOS; ++p)
+	{
+		if(client->sq[p].len)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static NetHandle net_handle(Net *net, size_t i)
+{
+	return (net->clients[i].gen << NET_SLOT_BITS) | (NetHandle)i;
 }
 
 static void client_connected(Net *net, size_t i)
@@ -117,27 +190,60 @@ static void client_connected(Net *net, size_t i)
 		return;
 	}
 
-	net_connected(client->addr);
+	net_connected(client->addr, net_handle(net, i));
 	client->connected = 1;
-	if(!client->rp)
+	if(!client_pending(client))
 	{
 		pollfd_done_writing(pfd);
 	}
 }
 
+/* Hands the complete frames in the buffer to net_received() and
+   returns the number of bytes they took, -1 to drop the connection */
+static ssize_t client_deliver(Net *net, size_t i)
+{
+	Client *client = net->clients + i;
+	ssize_t result = net_received(client->addr, net_handle(net, i),
+		client->buf, client->wp);
+	if(result < 0 || (!result && client->wp == client->cap))
+	{
+		/* Invalid or larger than the buffer */
+		return -1;
+	}
+
+	if(result > 0)
+	{
+		memmove(client->buf, client->buf + result, client->wp - result);
+		client->wp -= result;
+	}
+
+	return result;
+}
+
+/* Reads are scheduled by deficit round robin: every round a connection
+   earns read_quantum bytes and is charged the length of every frame it
+   delivers. It reads no further than its deficit, so a frame that does
+   not fit stays partly in the socket and the deficit carries over until
+   it does. A peer flooding frames can't delay the others by more than
+   one quantum each round. A connection whose socket drains forfeits
+   what it has not used. */
 static int client_read(Net *net, size_t i)
 {
 	Client *client = net->clients + i;
 	int fd = net->cfds[i].fd;
 	ssize_t result;
+	client->deficit += net->read_quantum;
 	for(;;)
 	{
-		if(client->wp >= client->cap)
+		size_t limit = client->deficit < client->cap ?
+			client->deficit : client->cap;
+		if(client->wp >= limit)
 		{
-			return -1;
+			/* The next frame is longer than the deficit */
+			return 0;
 		}
 
-		result = read(fd, client->buf + client->wp, client->cap - client->wp);
+		result = read(fd, client->buf + client->wp, limit - client->wp);
 		if(result == 0)
 		{
 			return -1;
@@ -146,60 +252,132 @@ static int client_read(Net *net, size_t i)
 		{
 			if(errno == EAGAIN || errno == EWOULDBLOCK)
 			{
-				break;
+				/* A partial frame in the buffer stays paid for */
+				client->deficit = client->wp;
+				return 0;
 			}
 
 			return -1;
 		}
 
 		client->wp += result;
+		if((result = client_deliver(net, i)) < 0)
+		{
+			return -1;
+		}
+
+		client->deficit -= result;
 	}
+}
+
+/* Frames that are not going to be sent are handed back to the
+   application, which can tell the sender */
+static void client_drop(NetFrame *f, void *ctx)
+{
+	Client *client = ctx;
+	net_dropped(client->addr, f->buf, f->len);
+	sfree(f->buf);
+}
 
-	result = net_received(client->addr, client->buf, client->wp);
-	if(result < 0)
+/* Takes ownership of buf, which is dropped if the frame can't be queued */
+static int client_add_msg(Client *client,
+	struct pollfd *pfd, u32 prio, void *buf, size_t len)
+{
+	NetQueue *q = client->sq + (prio < NET_PRIOS ? prio : NET_PRIOS - 1);
+	NetFrame f = { buf, len, 0 };
+	if(q->bytes + len > client->scap || netq_push(q, buf, len, time_us()))
 	{
+		client_drop(&f, client);
 		return -1;
 	}
 
-	if(result > 0)
+	pollfd_start_writing(pfd);
+	return 0;
+}
+
+/* Gathers the unfinished frame followed by the queued frames in class
+   order. Returns the number of iovecs filled. */
+static int client_gather(Client *client, struct iovec *iov)
+{
+	int n = 0;
+	if(client->cur.buf)
 	{
-		memmove(client->buf, client->buf + result, client->wp - result);
-		client->wp -= result;
+		iov[n].iov_base = client->cur.buf + client->cur_off;
+		iov[n++].iov_len = client->cur.len - client->cur_off;
 	}
 
-	return 0;
+	for(u32 p = 0; p < NET_PRIOS && n < NET_IOV_MAX; ++p)
+	{
+		NetFrame *f;
+		for(size_t i = 0; n < NET_IOV_MAX &&
+			(f = netq_peek(client->sq + p, i)); ++i)
+		{
+			iov[n].iov_base = f->buf;
+			iov[n++].iov_len = f->len;
+		}
+	}
+
+	return n;
 }
 
-static int client_add_msg(Client *client,
-	struct pollfd *pfd, void *buf, size_t len)
+/* Drops written bytes from the front in the order client_gather() used */
+static void client_consume(Client *client, size_t written)
 {
-	if(client->rp + len > client->cap)
+	u32 p = 0;
+	while(written > 0)
 	{
-		return -1;
+		size_t left;
+		if(!client->cur.buf)
+		{
+			while(!client->sq[p].len)
+			{
+				++p;
+			}
+
+			netq_pop(client->sq + p, &client->cur);
+			client->cur_off = 0;
+		}
+
+		left = client->cur.len - client->cur_off;
+		if(written < left)
+		{
+			client->cur_off += written;
+			return;
+		}
+
+		written -= left;
+		sfree(client->cur.buf);
+		client->cur.buf = NULL;
 	}
+}
 
-	pollfd_start_writing(pfd);
-	memcpy(client->sbuf + client->rp, buf, len);
-	client->rp += len;
-	return 0;
+/* Bulk frames pass through CoDel before every write, which drops from
+   the head of the queue while a standing queue persists. The frame it
+   lets through goes back to the head to be gathered in order. */
+static void client_aqm(Client *client)
+{
+	NetQueue *q = client->sq + NET_PRIO_BULK;
+	NetFrame f;
+	if(codel_dequeue(&client->codel, q, time_us(), &f, client_drop, client))
+	{
+		netq_unpop(q, &f);
+	}
 }
 
 static int client_write(Client *client, struct pollfd *pfd)
 {
-	int fd;
+	struct iovec iov[NET_IOV_MAX];
 	ssize_t result;
-	size_t pos;
-
-	fd = pfd->fd;
-	pos = 0;
+	int n;
 	for(;;)
 	{
-		if(pos == client->rp)
+		client_aqm(client);
+		if(!(n = client_gather(client, iov)))
 		{
 			break;
 		}
 
-		result = write(fd, client->sbuf + pos, client->rp - pos);
+		result = writev(pfd->fd, iov, n);
 		if(result == 0)
 		{
 			return -1;
@@ -214,16 +392,10 @@ static int client_write(Client *client, struct pollfd *pfd)
 			return -1;
 		}
 
-		pos += result;
-	}
-
-	if(pos > 0)
-	{
-		memmove(client->sbuf, client->sbuf + pos, client->rp - pos);
-		client->rp -= pos;
+		client_consume(client, result);
 	}
 
-	if(!client->rp)
+	if(!client_pending(client))
 	{
 		pollfd_done_writing(pfd);
 	}
@@ -236,7 +408,7 @@ static int client_send_recv(Net *net, size_t i)
 	Client *client = net->clients + i;
 	struct pollfd *pfd = net->cfds + i;
 
-	if(pfd->fd <= 0)
+	if(pfd->fd < 0)
 	{
 		return 0;
 	}
@@ -268,6 +440,11 @@ static int client_send_recv(Net *net, size_t i)
 
 static void net_notify(Net *net, NetCmd *cmd)
 {
+	if(cmd)
+	{
+		cmd->queued = time_us();
+	}
+
 	if(write(net->qfds[1], &cmd, sizeof(cmd)) < 0)
 	{
 		perror("write() to pipe failed");
@@ -290,10 +467,13 @@ static void close_checked(int *fd)
 
 static void net_free(Net *net)
 {
-	for(size_t i = 0; i < net->num_clients; ++i)
+	for(size_t i = 0; i < net->num_slots; ++i)
 	{
-		close_checked(&net->cfds[i].fd);
-		client_free(&net->clients[i]);
+		if(net->cfds[i].fd >= 0)
+		{
+			close(net->cfds[i].fd);
+			client_free(&net->clients[i]);
+		}
 	}
 
 	close_checked(net->qfds + 0);
@@ -302,39 +482,91 @@ static void net_free(Net *net)
 
 	sfree(net->fds);
 	sfree(net->clients);
+	sfree(net->free_slots);
 	sfree(net);
 }
 
+/* Closing a connection only releases its slot, other clients keep their
+   index. The slot's generation changes so that old handles to it are
+   no longer accepted. */
 static void net_client_close(Net *net, size_t idx)
 {
+	Client *client = net->clients + idx;
 	struct pollfd *pfd = net->cfds + idx;
 	close(pfd->fd);
-	pfd->fd = 0;
-	client_free(&net->clients[idx]);
+	pfd->fd = -1;
+	pfd->revents = 0;
+	if(client->connected)
+	{
+		net_disconnected(client->addr);
+	}
+	else
+	{
+		char buf[IPV4_STRBUF];
+		net_log("Failed to connect to %s", ip_to_str(buf, client->addr));
+	}
+
+	client_free(client);
+	client->gen = (client->gen + 1) & NET_GEN_MASK;
+	if(!client->gen)
+	{
+		client->gen = 1;
+	}
+
+	net->free_slots[net->num_free++] = idx;
 }
 
-static int server_client_add(Net *net,
+static ssize_t server_client_add(Net *net,
 	int cfd, struct sockaddr_in *cliaddr, int flags)
 {
-	if(net->num_clients >= net->max_clients)
+	size_t idx;
+	if(net->num_free)
+	{
+		idx = net->free_slots[--net->num_free];
+	}
+	else if(net->num_slots < net->max_clients)
+	{
+		idx = net->num_slots++;
+		net->clients[idx].gen = 1;
+	}
+	else
 	{
 		return -1;
 	}
 
-	client_init(net->clients + net->num_clients, net->bufsiz, cliaddr,
-		(flags & POLLOUT) ? 0 : 1);
+	client_init(net->clients + idx, net->bufsiz, net->sbufsiz,
+		cliaddr, (flags & POLLOUT) ? 0 : 1);
 
-	pollfd_init(net->cfds + net->num_clients, cfd, flags);
-	++net->num_clients;
-	return 0;
+	pollfd_init(net->cfds + idx, cfd, flags);
+
+	/* Keeps the kernel from buffering more than a few frames that have
+	   not been sent yet. The backlog stays in the send queues, where
+	   frames can still be prioritised and dropped by age. */
+	int lowat = NET_NOTSENT_LOWAT;
+	if(setsockopt(cfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+		&lowat, sizeof(lowat)) < 0)
+	{
+		net_log("setsockopt(TCP_NOTSENT_LOWAT) failed: %s", strerror(errno));
+	}
+
+	if(net->busy_poll_us)
+	{
+		int us = net->busy_poll_us;
+		if(setsockopt(cfd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0)
+		{
+			net_log("setsockopt(SO_BUSY_POLL) failed: %s", strerror(errno));
+		}
+	}
+
+	return idx;
 }
 
 static ssize_t server_client_find(Net *net, ip_addr dst)
 {
 	ssize_t i;
-	for(i = 0; i < (ssize_t)net->num_clients; ++i)
+	for(i = 0; i < (ssize_t)net->num_slots; ++i)
 	{
-		if(net->clients[i].addr == dst)
+		if(net->cfds[i].fd >= 0 && net->clients[i].addr == dst)
 		{
 			return i;
 		}
@@ -343,6 +575,20 @@ static ssize_t server_client_find(Net *net, ip_addr dst)
 	return -1;
 }
 
+/* A handle whose generation matches its slot is used as is, anything
+   else falls back to searching by address */
+static ssize_t server_client_resolve(Net *net, NetHandle handle, ip_addr dst)
+{
+	size_t idx = handle & NET_SLOT_MASK;
+	if(idx < net->num_slots && net->cfds[idx].fd >= 0 &&
+		net->clients[idx].gen == handle >> NET_SLOT_BITS)
+	{
+		return idx;
+	}
+
+	return server_client_find(net, dst);
+}
+
 static void net_msg_connect(Net *net, ip_addr ip, u16 port)
 {
 	int cfd;
@@ -369,7 +615,9 @@ static void net_msg_connect(Net *net, ip_addr ip, u16 port)
 
 	if(ret == 0 || (ret < 0 && errno == EINPROGRESS))
 	{
-		if(server_client_add(net, cfd, &addr, POLLIN | POLLPRI | POLLOUT) < 0)
+		ssize_t idx;
+		if((idx = server_client_add(net, cfd, &addr,
+			POLLIN | POLLPRI | POLLOUT)) < 0)
 		{
 			net_log("Maximum number of clients reached");
 			close(cfd);
@@ -378,7 +626,7 @@ static void net_msg_connect(Net *net, ip_addr ip, u16 port)
 
 		if(ret == 0)
 		{
-			client_connected(net, net->num_clients - 1);
+			client_connected(net, idx);
 		}
 
 		return;
@@ -388,17 +636,19 @@ static void net_msg_connect(Net *net, ip_addr ip, u16 port)
 	close(cfd);
 }
 
-static void net_msg_send(Net *net, ip_addr dst, void *buf, size_t len)
+static void net_msg_send(Net *net, NetHandle handle, ip_addr dst,
+	u32 prio, void *buf, size_t len)
 {
-	ssize_t cli = server_client_find(net, dst);
+	ssize_t cli = server_client_resolve(net, handle, dst);
 	if(cli < 0)
 	{
 		char ip_buf[IPV4_STRBUF];
 		net_log("Connection to %s not found", ip_to_str(ip_buf, dst));
+		sfree(buf);
 		return;
 	}
 
-	client_add_msg(net->clients + cli, net->cfds + cli, buf, len);
+	client_add_msg(net->clients + cli, net->cfds + cli, prio, buf, len);
 }
 
 static void net_msg_disconnect(Net *net, ip_addr dst)
@@ -414,8 +664,103 @@ static void net_msg_disconnect(Net *net, ip_addr dst)
 	net_client_close(net, cli);
 }
 
+/* listen() on a listening socket only updates the queue length */
+static void net_msg_backlog(Net *net, int backlog)
+{
+	if(listen(net->sfd, backlog) < 0)
+	{
+		net_log("listen(%d) failed: %s", backlog, strerror(errno));
+		return;
+	}
+
+	net->backlog = backlog;
+	net_log("Accept backlog set to %d", backlog);
+}
+
+/* Histogram of the time between queueing a command and the net thread
+   picking it up. Bucket i counts wakeups below 2^i microseconds. */
+static void net_wakeup_record(Net *net, u64 us)
+{
+	u32 i = 0;
+	while(i < WAKEUP_BUCKETS - 1 && us >= (1ull << i))
+	{
+		++i;
+	}
+
+	++net->wakeup_hist[i];
+	if(us > net->wakeup_max)
+	{
+		net->wakeup_max = us;
+	}
+}
+
+static u64 net_wakeup_percentile(Net *net, u64 total, u32 pct)
+{
+	u64 sum = 0, want = (total * pct + 99) / 100;
+	for(u32 i = 0; i < WAKEUP_BUCKETS; ++i)
+	{
+		sum += net->wakeup_hist[i];
+		if(sum >= want)
+		{
+			return 1ull << i;
+		}
+	}
+
+	return 1ull << (WAKEUP_BUCKETS - 1);
+}
+
+static void net_msg_wakeup(Net *net)
+{
+	u64 total = 0;
+	for(u32 i = 0; i < WAKEUP_BUCKETS; ++i)
+	{
+		total += net->wakeup_hist[i];
+	}
+
+	net_log("Wakeup latency (busy poll %u us): %llu samples", net->busy_poll_us,
+		(unsigned long long)total);
+	if(!total)
+	{
+		return;
+	}
+
+	for(u32 i = 0; i < WAKEUP_BUCKETS; ++i)
+	{
+		if(net->wakeup_hist[i])
+		{
+			net_log("  < %llu us: %llu", 1ull << i,
+				(unsigned long long)net->wakeup_hist[i]);
+		}
+	}
+
+	net_log("  p50 < %llu us, p99 < %llu us, max %llu us",
+		(unsigned long long)net_wakeup_percentile(net, total, 50),
+		(unsigned long long)net_wakeup_percentile(net, total, 99),
+		(unsigned long long)net->wakeup_max);
+}
+
+/* Changing the mode starts a new histogram, so the two can be compared */
+static void net_msg_busy_poll(Net *net, u32 us)
+{
+	net->busy_poll_us = us;
+	memset(net->wakeup_hist, 0, sizeof(net->wakeup_hist));
+	net->wakeup_max = 0;
+	for(size_t i = 0; i < net->num_slots; ++i)
+	{
+		int val = us;
+		if(net->cfds[i].fd >= 0)
+		{
+			setsockopt(net->cfds[i].fd, SOL_SOCKET, SO_BUSY_POLL,
+				&val, sizeof(val));
+		}
+	}
+
+	net_log("Busy polling %s (%u us)", us ? "enabled" : "disabled", us);
+}
+
 static void net_cmd_handle(Net *net, NetCmd *msg)
 {
+	net_wakeup_record(net, time_us() - msg->queued);
 	switch(msg->type)
 	{
 	case NET_CMD_CONNECT:
@@ -427,8 +772,24 @@ static void net_cmd_handle(Net *net, NetCmd *msg)
 		break;
 
 	case NET_CMD_SEND:
-		net_msg_send(net, msg->dst, msg->buf, msg->len);
-		sfree(msg->buf);
+		net_msg_send(net, msg->handle, msg->dst, msg->prio,
+			msg->buf, msg->len);
+		break;
+
+	case NET_CMD_BACKLOG:
+		net_msg_backlog(net, msg->len);
+		break;
+
+	case NET_CMD_BUSY_POLL:
+		net_msg_busy_poll(net, msg->len);
+		break;
+
+	case NET_CMD_WAKEUP:
+		net_msg_wakeup(net);
+		break;
+
+	case NET_CMD_POST:
+		net_posted(msg->dst, msg->buf, msg->len);
 		break;
 	}
 
@@ -474,95 +835,110 @@ static int net_accept(Net *net)
 		return 0;
 	}
 
-	for(;;)
+	/* Connections left over when the budget runs out keep the listening
+	   socket readable and are picked up in the next round */
+	for(u32 n = 0; n < net->accept_budget; ++n)
 	{
 		int cfd;
 		struct sockaddr_in cliaddr;
 		socklen_t addrlen = sizeof(cliaddr);
-		if((cfd = accept(net->sfd, (struct sockaddr *)&cliaddr, &addrlen)) < 0)
+		if((cfd = accept4(net->sfd, (struct sockaddr *)&cliaddr, &addrlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
 		{
 			if(errno == EAGAIN || errno == EWOULDBLOCK)
 			{
 				break;
 			}
 
-			net_log("accept() failed: %s", strerror(errno));
-			return -1;
-		}
+			if(errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
 
-		if(fd_set_non_blocking(cfd) < 0)
-		{
-			net_log("fcntl(O_NONBLOCK) failed: %s", strerror(errno));
-			close(cfd);
+			net_log("accept4() failed: %s", strerror(errno));
 			return -1;
 		}
 
 		net_log("Accepted client (%s)", inet_ntoa(cliaddr.sin_addr));
-		if(server_client_add(net, cfd, &cliaddr, POLLIN | POLLPRI) < 0)
+		ssize_t idx;
+		if((idx = server_client_add(net, cfd, &cliaddr, POLLIN | POLLPRI)) < 0)
 		{
 			close(cfd);
 			return -1;
 		}
 
-		net_connected(sockaddr_to_uint(&cliaddr));
+		net_connected(sockaddr_to_uint(&cliaddr), net_handle(net, idx));
 	}
 
 	return 0;
 }
 
-static void net_remove_closed(Net *net)
+/* The starting slot rotates, so no connection is always served first */
+static void net_send_recv(Net *net)
 {
-	size_t src, dst;
-	Client *clients = net->clients;
-	struct pollfd *fds = net->cfds;
-	for(src = 0, dst = 0; src < net->num_clients; ++src)
+	size_t n, start = net->rr_next;
+	if(!net->num_slots)
 	{
-		if(fds[src].fd > 0)
-		{
-			if(dst != src)
-			{
-				clients[dst] = clients[src];
-				fds[dst] = fds[src];
-			}
+		return;
+	}
 
-			++dst;
-		}
-		else
+	if(start >= net->num_slots)
+	{
+		start = 0;
+	}
+
+	for(n = 0; n < net->num_slots; ++n)
+	{
+		size_t i = (start + n) % net->num_slots;
+		if(client_send_recv(net, i) < 0)
 		{
-			if(clients[dst].connected)
-			{
-				net_disconnected(clients[dst].addr);
-			}
-			else
-			{
-				char buf[IPV4_STRBUF];
-				net_log("Failed to connect to %s",
-					ip_to_str(buf, clients[dst].addr));
-			}
+			net_client_close(net, i);
 		}
 	}
 
-	net->num_clients = dst;
+	net->rr_next = start + 1;
 }
 
-static void net_send_recv(Net *net)
+static void net_check_tick(Net *net)
 {
-	size_t i;
-	for(i = 0; i < net->num_clients; ++i)
+	u64 now = time_us();
+	if(now - net->last_tick >= NET_TICK_MS * 1000)
 	{
-		if(client_send_recv(net, i) < 0)
+		net->last_tick = now;
+		net_tick();
+	}
+}
+
+/* In busy poll mode the thread spins with non-blocking polls for up to
+   busy_poll_us before it goes to sleep, trading CPU time for not having
+   to be woken up by the scheduler */
+static int net_poll(Net *net)
+{
+	nfds_t nfds = net->num_slots + OFFSET_FD;
+	if(net->busy_poll_us)
+	{
+		u64 start = time_us();
+		do
 		{
-			net_client_close(net, i);
+			int result = poll(net->fds, nfds, 0);
+			if(result)
+			{
+				return result;
+			}
 		}
+		while(time_us() - start < net->busy_poll_us);
 	}
+
+	return poll(net->fds, nfds, NET_TICK_MS);
 }
 
 static int net_update(Net *net)
 {
-	int result = poll(net->fds, net->num_clients + OFFSET_FD, -1);
+	int result = net_poll(net);
 	if(!result)
 	{
 		/* Timed out */
+		net_check_tick(net);
 		return 0;
 	}
 	else if(result < 0)
@@ -584,23 +960,27 @@ static int net_update(Net *net)
 
 	net_accept(net);
 	net_send_recv(net);
-	net_remove_closed(net);
+	net_check_tick(net);
 	return 0;
 }
 
 static void *net_thread_poll(void *args)
 {
-	while(!net_update(args)) {}
+	Net *net = args;
+	net->thread = pthread_self();
+	while(!net_update(net)) {}
 	return NULL;
 }
 
 static void net_init_clients(Net *net, size_t max_clients)
 {
-	net->num_clients = 0;
+	net->num_slots = 0;
+	net->num_free = 0;
 	net->max_clients = max_clients;
 	net->fds = smalloc((max_clients + OFFSET_FD) * sizeof(*net->fds));
 	net->cfds = net->fds + OFFSET_FD;
 	net->clients = smalloc(max_clients * sizeof(*net->clients));
+	net->free_slots = smalloc(max_clients * sizeof(*net->free_slots));
 }
 
 static int net_init_thread(Net *net)
@@ -612,6 +992,17 @@ static int net_init_thread(Net *net)
 	}
 
 	net->started = 1;
+	if(net->cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(net->cpu, &set);
+		if(pthread_setaffinity_np(net->thread, sizeof(set), &set))
+		{
+			fprintf(stderr, "Failed to pin net thread to CPU %d\n", net->cpu);
+		}
+	}
+
 	return 0;
 }
 
@@ -656,7 +1047,7 @@ static int net_init_socket(Net *net)
 		return -1;
 	}
 
-	if(listen(net->sfd, ACCEPT_QUEUE_SIZE) < 0)
+	if(listen(net->sfd, net->backlog) < 0)
 	{
 		perror("listen() failed");
 		return -1;
@@ -666,13 +1057,20 @@ static int net_init_socket(Net *net)
 	return 0;
 }
 
-Net *net_start(size_t max_clients, size_t buf_size, u16 port)
+Net *net_start(const NetConfig *cfg)
 {
 	Net *net = smalloc(sizeof(*net));
 	memset(net, 0, sizeof(*net));
-	net->port = port;
-	net->bufsiz = buf_size;
-	net_init_clients(net, max_clients);
+	net->port = cfg->port;
+	net->bufsiz = cfg->buf_size;
+	net->sbufsiz = cfg->sbuf_size;
+	net->backlog = cfg->backlog;
+	net->accept_budget = cfg->accept_budget ? cfg->accept_budget : 1;
+	net->read_quantum = cfg->read_quantum ? cfg->read_quantum : 1;
+	net->busy_poll_us = cfg->busy_poll_us;
+	net->cpu = cfg->cpu;
+	net->last_tick = time_us();
+	net_init_clients(net, cfg->max_clients);
 	if(net_init_cmd_pipe(net) ||
 		net_init_socket(net) ||
 		net_init_thread(net))
@@ -698,9 +1096,48 @@ void net_quit(Net *net)
 
 void net_send(Net *net, ip_addr dst, void *buf, size_t len)
 {
-	NetCmd *cmd = smalloc(sizeof(*cmd));
+	net_send_to(net, NET_HANDLE_NONE, dst, NET_PRIO_BULK, buf, len);
+}
+
+void net_send_to(Net *net, NetHandle handle, ip_addr dst, u32 prio,
+	void *buf, size_t len)
+{
+	NetCmd *cmd;
+	if(pthread_equal(pthread_self(), net->thread))
+	{
+		/* Frames sent from callbacks, like routing updates or NACKs for
+		   dropped frames, are queued right away. The net thread would
+		   otherwise fill up its own command pipe. */
+		net_msg_send(net, handle, dst, prio, buf, len);
+		return;
+	}
+
+	cmd = smalloc(sizeof(*cmd));
 	cmd->type = NET_CMD_SEND;
+	cmd->handle = handle;
 	cmd->dst = dst;
+	cmd->prio = prio;
+	cmd->buf = buf;
+	cmd->len = len;
+	net_notify(net, cmd);
+}
+
+/* Hands buf to net_posted() on the net thread, for work on state only
+   the net thread may touch, like the routing table */
+void net_post(Net *net, ip_addr dst, void *buf, size_t len)
+{
+	NetCmd *cmd;
+	if(pthread_equal(pthread_self(), net->thread))
+	{
+		net_posted(dst, buf, len);
+		return;
+	}
+
+	cmd = smalloc(sizeof(*cmd));
+	cmd->type = NET_CMD_POST;
+	cmd->handle = NET_HANDLE_NONE;
+	cmd->dst = dst;
+	cmd->prio = 0;
 	cmd->buf = buf;
 	cmd->len = len;
 	net_notify(net, cmd);
@@ -710,6 +1147,7 @@ void net_connect(Net *net, ip_addr dst)
 {
 	NetCmd *cmd = smalloc(sizeof(*cmd));
 	cmd->type = NET_CMD_CONNECT;
+	cmd->handle = NET_HANDLE_NONE;
 	cmd->dst = dst;
 	cmd->buf = NULL;
 	cmd->len = 0;
@@ -720,8 +1158,51 @@ void net_disconnect(Net *net, ip_addr dst)
 {
 	NetCmd *cmd = smalloc(sizeof(*cmd));
 	cmd->type = NET_CMD_DISCONNECT;
+	cmd->handle = NET_HANDLE_NONE;
 	cmd->dst = dst;
 	cmd->buf = NULL;
 	cmd->len = 0;
 	net_notify(net, cmd);
 }
+
+void net_set_backlog(Net *net, int backlog)
+{
+	NetCmd *cmd = smalloc(sizeof(*cmd));
+	cmd->type = NET_CMD_BACKLOG;
+	cmd->handle = NET_HANDLE_NONE;
+	cmd->dst = 0;
+	cmd->buf = NULL;
+	cmd->len = backlog;
+	net_notify(net, cmd);
+}
+
+void net_set_busy_poll(Net *net, u32 us)
+{
+	NetCmd *cmd = smalloc(sizeof(*cmd));
+	cmd->type = NET_CMD_BUSY_POLL;
+	cmd->handle = NET_HANDLE_NONE;
+	cmd->dst = 0;
+	cmd->buf = NULL;
+	cmd->len = us;
+	net_notify(net, cmd);
+}
+
+void net_report_wakeup(Net *net)
+{
+	NetCmd *cmd = smalloc(sizeof(*cmd));
+	cmd->type = NET_CMD_WAKEUP;
+	cmd->handle = NET_HANDLE_NONE;
+	cmd->dst = 0;
+	cmd->buf = NULL;
+	cmd->len = 0;
+	net_notify(net, cmd);
+}
+
+/* Bytes of frames of class prio waiting for the connection. Reads the
+   queues directly, so it may only be called from callbacks of the net
+   thread. */
+size_t net_queued(Net *net, NetHandle handle, ip_addr dst, u32 prio)
+{
+	ssize_t cli = server_client_resolve(net, handle, dst);
+	return cli < 0 ? 0 : net->clients[cli].sq[prio].bytes;
+}
@@ -6,21 +6,67 @@
 
 typedef struct Net Net;
 
+/* Refers to a connection by slot. Slots never move while in use; the
+   upper bits carry the slot's generation, which changes when the slot is
+   released, so a handle that outlived its connection is not used. */
+typedef u32 NetHandle;
+
+#define NET_HANDLE_NONE 0
+#define NET_SLOT_BITS   8
+
+/* Send classes, served in strict priority order */
+enum
+{
+	NET_PRIO_CONTROL,
+	NET_PRIO_BULK,
+	NET_PRIOS
+};
+
 typedef struct
 {
 	int type;
 } NetEvent;
 
-Net *net_start(size_t max_clients, size_t buf_size, u16 port);
+typedef struct
+{
+	size_t max_clients;
+	size_t buf_size;
+	size_t sbuf_size;
+	u16 port;
+	/* Length of the kernel's queue of pending connections */
+	int backlog;
+	/* Connections accepted per poll round before serving other sockets */
+	u32 accept_budget;
+	/* Bytes a connection may read per poll round, see client_read() */
+	u32 read_quantum;
+	/* Microseconds to spin on poll() before blocking, 0 to always block */
+	u32 busy_poll_us;
+	/* CPU the net thread is pinned to, -1 for none */
+	int cpu;
+} NetConfig;
+
+Net *net_start(const NetConfig *cfg);
 
 void net_log(const char *msg, ...);
 void net_disconnected(ip_addr addr);
-void net_connected(ip_addr addr);
-ssize_t net_received(ip_addr addr, const u8 *buf, size_t size);
+void net_connected(ip_addr addr, NetHandle handle);
+void net_dropped(ip_addr addr, const u8 *buf, size_t len);
+ssize_t net_received(ip_addr addr, NetHandle handle,
+	const u8 *buf, size_t size);
+void net_tick(void);
+/* Receives what net_post() was given, on the net thread */
+void net_posted(ip_addr dst, void *buf, size_t len);
 
 void net_quit(Net *net);
 void net_send(Net *net, ip_addr dst, void *buf, size_t len);
+void net_send_to(Net *net, NetHandle handle, ip_addr dst, u32 prio,
+	void *buf, size_t len);
+void net_post(Net *net, ip_addr dst, void *buf, size_t len);
 void net_connect(Net *net, ip_addr dst);
 void net_disconnect(Net *net, ip_addr ip);
+void net_set_backlog(Net *net, int backlog);
+void net_set_busy_poll(Net *net, u32 us);
+void net_report_wakeup(Net *net);
+size_t net_queued(Net *net, NetHandle handle, ip_addr dst, u32 prio);
 
 #endif
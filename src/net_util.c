@@ -24,6 +24,11 @@ ip_addr sockaddr_to_uint(struct sockaddr_in *addr)
 	return ntohl(addr->sin_addr.s_addr);
 }
 
+ip_addr ip_mask(u32 plen)
+{
+	return plen ? 0xFFFFFFFFu << (32 - plen) : 0;
+}
+
 ip_addr getip(void)
 {
 	ip_addr ip = 0;
@@ -12,5 +12,6 @@ ip_addr str_to_ip(const char *str);
 char *ip_to_str(char *out, ip_addr ip);
 ip_addr sockaddr_to_uint(struct sockaddr_in *addr);
 ip_addr getip(void);
+ip_addr ip_mask(u32 plen);
 
 #endif
@@ -0,0 +1,70 @@
+#include "netq.h"
+#include "util.h"
+
+void netq_init(NetQueue *q, size_t cap)
+{
+	q->head = 0;
+	q->len = 0;
+	q->cap = cap;
+	q->bytes = 0;
+	q->frames = smalloc(cap * sizeof(*q->frames));
+}
+
+/* Frames still queued are owned by the queue and freed with it */
+void netq_free(NetQueue *q)
+{
+	while(q->len)
+	{
+		NetFrame f;
+		netq_pop(q, &f);
+		sfree(f.buf);
+	}
+
+	sfree(q->frames);
+}
+
+/* Takes ownership of buf on success, returns -1 if the queue is full */
+int netq_push(NetQueue *q, u8 *buf, size_t len, u64 now)
+{
+	NetFrame *f;
+	if(q->len >= q->cap)
+	{
+		return -1;
+	}
+
+	f = q->frames + (q->head + q->len) % q->cap;
+	f->buf = buf;
+	f->len = len;
+	f->enqueued = now;
+	++q->len;
+	q->bytes += len;
+	return 0;
+}
+
+/* Returns the i-th frame from the head, NULL if there are fewer */
+NetFrame *netq_peek(NetQueue *q, size_t i)
+{
+	if(i >= q->len)
+	{
+		return NULL;
+	}
+
+	return q->frames + (q->head + i) % q->cap;
+}
+
+void netq_pop(NetQueue *q, NetFrame *out)
+{
+	*out = q->frames[q->head];
+	q->head = (q->head + 1) % q->cap;
+	--q->len;
+	q->bytes -= out->len;
+}
+
+/* Puts a frame taken with netq_pop() back at the head */
+void netq_unpop(NetQueue *q, const NetFrame *f)
+{
+	q->head = (q->head + q->cap - 1) % q->cap;
+	q->frames[q->head] = *f;
+	++q->len;
+	q->bytes += f->len;
+}
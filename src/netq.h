@@ -0,0 +1,28 @@
+#ifndef __NETQ_H__
+#define __NETQ_H__
+
+#include "types.h"
+
+typedef struct
+{
+	u8 *buf;
+	size_t len;
+	u64 enqueued;
+} NetFrame;
+
+/* Ring of frames waiting to be written to one connection */
+typedef struct
+{
+	size_t head, len, cap;
+	size_t bytes;
+	NetFrame *frames;
+} NetQueue;
+
+void netq_init(NetQueue *q, size_t cap);
+void netq_free(NetQueue *q);
+int netq_push(NetQueue *q, u8 *buf, size_t len, u64 now);
+NetFrame *netq_peek(NetQueue *q, size_t i);
+void netq_pop(NetQueue *q, NetFrame *out);
+void netq_unpop(NetQueue *q, const NetFrame *f);
+
+#endif
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "outbox.h"
+#include "pvl.h"
+#include "util.h"
+#include <stdio.h>
+
+void outbox_init(Outbox *o, ip_addr src, size_t max, const char *path,
+	void (*send)(ip_addr dst, const u8 *frame, size_t len),
+	int (*routed)(ip_addr dst))
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&o->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	o->depth = 0;
+	txwin_init(&o->tw, max, time_us() ^ src, send);
+	snprintf(o->path, sizeof(o->path), "%s", path);
+	spool_init(&o->spool, SPOOL_DSTS, o->path);
+	o->src = src;
+	o->seq = OUTBOX_HANDLE_MIN;
+	o->routed = routed;
+	o->done = NULL;
+	o->done_tail = NULL;
+}
+
+/* Queues the callback of m, it runs on the outermost unlock */
+static void outbox_complete(OutboxMsg *m, int status)
+{
+	Outbox *o = m->box;
+	m->status = status;
+	m->latency = time_us() - m->queued;
+	m->next = NULL;
+	if(o->done_tail)
+	{
+		o->done_tail->next = m;
+	}
+	else
+	{
+		o->done = m;
+	}
+
+	o->done_tail = m;
+}
+
+static void outbox_tx_done(ip_addr dst, u32 msgid, int status, void *ctx)
+{
+	outbox_complete(ctx, status);
+	(void)dst;
+	(void)msgid;
+}
+
+/* Completes the messages left in the spool and the send window */
+void outbox_free(Outbox *o)
+{
+	outbox_lock(o);
+	for(size_t i = 0; i < o->spool.len; ++i)
+	{
+		SpoolQueue *q = o->spool.queues + i;
+		for(size_t j = 0; j < q->len; ++j)
+		{
+			SpoolEntry *e = q->ring + (q->head + j) % SPOOL_MAX;
+			outbox_complete(e->ctx, TX_DROPPED);
+			e->ctx = NULL;
+		}
+	}
+
+	txwin_free(&o->tw);
+	outbox_unlock(o);
+	spool_free(&o->spool, o->path);
+	pthread_mutex_destroy(&o->lock);
+}
+
+void outbox_lock(Outbox *o)
+{
+	pthread_mutex_lock(&o->lock);
+	++o->depth;
+}
+
+void outbox_unlock(Outbox *o)
+{
+	OutboxMsg *m;
+	if(o->depth == 1)
+	{
+		while((m = o->done))
+		{
+			if(!(o->done = m->next))
+			{
+				o->done_tail = NULL;
+			}
+
+			m->cb(m->handle, m->dst, m->status, m->latency, m->ctx);
+			sfree(m);
+		}
+	}
+
+	--o->depth;
+	pthread_mutex_unlock(&o->lock);
+}
+
+/* Moves what waits in q into the send window while dst has a route and
+   the window queue has room, oldest first */
+static void outbox_flush_queue(Outbox *o, SpoolQueue *q)
+{
+	const SpoolEntry *e;
+	while((e = spool_head(q)))
+	{
+		OutboxMsg *m = e->ctx;
+		u32 msgid;
+		size_t len;
+		u8 *frame;
+		if(!o->routed(q->dst) || txwin_next_id(&o->tw, q->dst, &msgid))
+		{
+			break;
+		}
+
+		if(!(frame = spool_pop(&o->spool, q, &len)))
+		{
+			outbox_complete(m, TX_DROPPED);
+			continue;
+		}
+
+		pvl_set_msgid(frame, msgid);
+		pvl_set_crc(frame, pvl_calc_crc(frame));
+		txwin_submit(&o->tw, q->dst, frame, len, outbox_tx_done, m,
+			time_us());
+	}
+}
+
+/* Spools a message to dst until the next outbox_flush() and returns a
+   handle above OUTBOX_HANDLE_MIN that is passed to cb once the message
+   is acknowledged, NACKed, timed out or dropped. Returns 0 if the spool
+   of dst is full, cb is then never called. */
+u32 outbox_send(Outbox *o, ip_addr dst, const char *msg, size_t len,
+	OutboxDone cb, void *ctx)
+{
+	OutboxMsg *m;
+	u32 handle;
+	size_t size = PVL_HEADER_SIZE + PVL_MSG_HEADER_SIZE + len;
+	u8 *buf = scalloc(size);
+	pvl_set_version(buf);
+	pvl_set_msgtype(buf, PVL_MESSAGE);
+	pvl_set_length(buf, len);
+
+	pvl_set_dst(buf, dst);
+	pvl_set_src(buf, o->src);
+
+	pvl_set_ttl(buf, 15);
+	pvl_set_msg_data(buf, msg, len);
+
+	m = smalloc(sizeof(*m));
+	m->box = o;
+	m->dst = dst;
+	m->queued = time_us();
+	m->cb = cb;
+	m->ctx = ctx;
+
+	outbox_lock(o);
+	if(++o->seq <= OUTBOX_HANDLE_MIN)
+	{
+		o->seq = OUTBOX_HANDLE_MIN + 1;
+	}
+
+	handle = m->handle = o->seq;
+	if(spool_push(&o->spool, dst, buf, size, m))
+	{
+		sfree(buf);
+		sfree(m);
+		outbox_unlock(o);
+		return 0;
+	}
+
+	outbox_unlock(o);
+	return handle;
+}
+
+/* Sends what waits for destinations that have a route again */
+void outbox_flush(Outbox *o)
+{
+	outbox_lock(o);
+	for(size_t i = 0; i < o->spool.len; ++i)
+	{
+		outbox_flush_queue(o, o->spool.queues + i);
+	}
+
+	outbox_unlock(o);
+}
+
+/* Acknowledged messages make room in the window for spooled ones */
+void outbox_ack(Outbox *o, ip_addr dst, u32 msgid, u64 now)
+{
+	outbox_sack(o, dst, msgid, 1, 0, now);
+}
+
+void outbox_sack(Outbox *o, ip_addr dst, u32 top, u64 map, int ce, u64 now)
+{
+	SpoolQueue *q;
+	outbox_lock(o);
+	txwin_sack(&o->tw, dst, top, map, ce, now);
+	if((q = spool_find(&o->spool, dst)))
+	{
+		outbox_flush_queue(o, q);
+	}
+
+	outbox_unlock(o);
+}
+
+void outbox_fail(Outbox *o, u32 msgid)
+{
+	outbox_lock(o);
+	txwin_fail(&o->tw, msgid);
+	outbox_unlock(o);
+}
+
+void outbox_congested(Outbox *o, u32 msgid)
+{
+	outbox_lock(o);
+	txwin_congested(&o->tw, msgid);
+	outbox_unlock(o);
+}
+
+void outbox_timers(Outbox *o, u64 now)
+{
+	outbox_lock(o);
+	txwin_timers(&o->tw, now);
+	outbox_unlock(o);
+}
@@ -0,0 +1,72 @@
+#ifndef __OUTBOX_H__
+#define __OUTBOX_H__
+
+#include "net_util.h"
+#include "txwin.h"
+#include "spool.h"
+#include <pthread.h>
+
+#define OUTBOX_HANDLE_MIN    16
+#define OUTBOX_PATH          64
+
+/* Called once for every message taken by outbox_send(). status is a
+   TX_* value, latency the time from the call until the ACK or the
+   failure. */
+typedef void (*OutboxDone)(u32 handle, ip_addr dst, int status,
+	u64 latency, void *ctx);
+
+/* A local message in the spool or the send window, or completed and
+   waiting for its callback */
+typedef struct OutboxMsg
+{
+	struct OutboxMsg *next;
+	struct Outbox *box;
+	u32 handle;
+	ip_addr dst;
+	u64 queued;
+	u64 latency;
+	int status;
+	OutboxDone cb;
+	void *ctx;
+} OutboxMsg;
+
+/* Our own messages. outbox_send() may be called from any thread and only
+   spools; messages enter the send window in outbox_flush(), outbox_ack()
+   and outbox_sack(), so routed and send are only called by the thread
+   that calls those and outbox_timers(), the one owning the routes. Each
+   destination has TX_QUEUE messages in the send window, up to SPOOL_MAX
+   more wait in the spool, as do messages without a route; they get an
+   id on leaving it. Completed messages are collected and their callbacks
+   run when the outermost outbox_unlock() returns the lock, still holding
+   it, which for sent messages is on that same thread. So the window is
+   consistent, callbacks may call any outbox function, and a caller
+   holding the lock sees no callback for a message it just sent. */
+typedef struct Outbox
+{
+	pthread_mutex_t lock;
+	int depth;
+	TxWin tw;
+	Spool spool;
+	char path[OUTBOX_PATH];
+	ip_addr src;
+	u32 seq;
+	int (*routed)(ip_addr dst);
+	OutboxMsg *done, *done_tail;
+} Outbox;
+
+void outbox_init(Outbox *o, ip_addr src, size_t max, const char *path,
+	void (*send)(ip_addr dst, const u8 *frame, size_t len),
+	int (*routed)(ip_addr dst));
+void outbox_free(Outbox *o);
+void outbox_lock(Outbox *o);
+void outbox_unlock(Outbox *o);
+u32 outbox_send(Outbox *o, ip_addr dst, const char *msg, size_t len,
+	OutboxDone cb, void *ctx);
+void outbox_flush(Outbox *o);
+void outbox_ack(Outbox *o, ip_addr dst, u32 msgid, u64 now);
+void outbox_sack(Outbox *o, ip_addr dst, u32 top, u64 map, int ce, u64 now);
+void outbox_fail(Outbox *o, u32 msgid);
+void outbox_congested(Outbox *o, u32 msgid);
+void outbox_timers(Outbox *o, u64 now);
+
+#endif
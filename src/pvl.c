@@ -50,7 +50,12 @@ u8 pvl_get_version(const u8 *buf)
 
 u8 pvl_get_msgtype(const u8 *buf)
 {
-	return buf[PVL_OFFSET_MSGTYPE];
+	return buf[PVL_OFFSET_MSGTYPE] & PVL_MSGTYPE_MASK;
+}
+
+u8 pvl_get_flags(const u8 *buf)
+{
+	return buf[PVL_OFFSET_MSGTYPE] & ~PVL_MSGTYPE_MASK;
 }
 
 u32 pvl_get_ttl(const u8 *buf)
@@ -78,6 +83,17 @@ void pvl_set_msgtype(u8 *buf, u8 msgtype)
 	buf[PVL_OFFSET_MSGTYPE] = msgtype;
 }
 
+/* Adds flags to the message type, which must be set before */
+void pvl_set_flags(u8 *buf, u8 flags)
+{
+	buf[PVL_OFFSET_MSGTYPE] |= flags & ~PVL_MSGTYPE_MASK;
+}
+
+void pvl_clear_flags(u8 *buf, u8 flags)
+{
+	buf[PVL_OFFSET_MSGTYPE] &= ~(flags & ~PVL_MSGTYPE_MASK);
+}
+
 void pvl_set_ttl(u8 *buf, u32 ttl)
 {
 	w32(buf + PVL_OFFSET_TTL, ttl);
@@ -139,6 +155,20 @@ size_t pvl_total_len(const u8 *buf)
 	case PVL_NACK:
 		len += PVL_NACK_HEADER_SIZE;
 		break;
+
+	case PVL_SACK:
+		len += PVL_SACK_HEADER_SIZE;
+		break;
+
+	case PVL_MULTICAST:
+		len += PVL_MCAST_HEADER_SIZE;
+		break;
+
+	case PVL_FILE_OFFER:
+	case PVL_FILE_CHUNK:
+	case PVL_FILE_ACK:
+		len += PVL_FILE_HEADER_SIZE;
+		break;
 	}
 
 	return len;
@@ -207,24 +237,125 @@ void pvl_print_msgheader(const u8 *buf)
 		pvl_get_ttl(buf));
 }
 
+static u8 *pvl_route(const u8 *buf, int i)
+{
+	size_t offset = PVL_HEADER_SIZE + i * PVL_ROUTE_SIZE;
+	if(pvl_get_msgtype(buf) == PVL_ROUTING_PART)
+	{
+		offset += PVL_RT_PART_HEADER_SIZE;
+	}
+
+	return (u8 *)buf + offset;
+}
+
 ip_addr pvl_get_route_dst(const u8 *buf, int i)
 {
-	return r32(buf + PVL_HEADER_SIZE + i * PVL_ROUTE_SIZE + PVL_OFFSET_ROUTE_DST);
+	return r32(pvl_route(buf, i) + PVL_OFFSET_ROUTE_DST);
 }
 
 u32 pvl_get_route_hops(const u8 *buf, int i)
 {
-	return r32(buf + PVL_HEADER_SIZE + i * PVL_ROUTE_SIZE + PVL_OFFSET_ROUTE_HOPS);
+	return r32(pvl_route(buf, i) + PVL_OFFSET_ROUTE_HOPS);
 }
 
 void pvl_set_route_dst(u8 *buf, int i, ip_addr dst)
 {
-	w32(buf + PVL_HEADER_SIZE + i * PVL_ROUTE_SIZE + PVL_OFFSET_ROUTE_DST, dst);
+	w32(pvl_route(buf, i) + PVL_OFFSET_ROUTE_DST, dst);
 }
 
 void pvl_set_route_hops(u8 *buf, int i, u32 hops)
 {
-	w32(buf + PVL_HEADER_SIZE + i * PVL_ROUTE_SIZE + PVL_OFFSET_ROUTE_HOPS, hops);
+	w32(pvl_route(buf, i) + PVL_OFFSET_ROUTE_HOPS, hops);
+}
+
+u32 pvl_get_route_cost(const u8 *buf, int i)
+{
+	return r32(pvl_route(buf, i) + PVL_OFFSET_ROUTE_COST);
+}
+
+void pvl_set_route_cost(u8 *buf, int i, u32 cost)
+{
+	w32(pvl_route(buf, i) + PVL_OFFSET_ROUTE_COST, cost);
+}
+
+u32 pvl_get_route_plen(const u8 *buf, int i)
+{
+	return pvl_route(buf, i)[PVL_OFFSET_ROUTE_PLEN];
+}
+
+void pvl_set_route_plen(u8 *buf, int i, u32 plen)
+{
+	pvl_route(buf, i)[PVL_OFFSET_ROUTE_PLEN] = plen;
+}
+
+u32 pvl_get_rt_epoch(const u8 *buf)
+{
+	return r32(buf + PVL_OFFSET_RT_EPOCH);
+}
+
+void pvl_set_rt_epoch(u8 *buf, u32 epoch)
+{
+	w32(buf + PVL_OFFSET_RT_EPOCH, epoch);
+}
+
+u16 pvl_get_rt_part(const u8 *buf)
+{
+	return r16(buf + PVL_OFFSET_RT_PART);
+}
+
+void pvl_set_rt_part(u8 *buf, u16 part)
+{
+	w16(buf + PVL_OFFSET_RT_PART, part);
+}
+
+u16 pvl_get_rt_parts(const u8 *buf)
+{
+	return r16(buf + PVL_OFFSET_RT_PARTS);
+}
+
+void pvl_set_rt_parts(u8 *buf, u16 parts)
+{
+	w16(buf + PVL_OFFSET_RT_PARTS, parts);
+}
+
+ip_addr pvl_get_lsa_origin(const u8 *buf)
+{
+	return r32(buf + PVL_OFFSET_LSA_ORIGIN);
+}
+
+void pvl_set_lsa_origin(u8 *buf, ip_addr origin)
+{
+	w32(buf + PVL_OFFSET_LSA_ORIGIN, origin);
+}
+
+u32 pvl_get_lsa_seq(const u8 *buf)
+{
+	return r32(buf + PVL_OFFSET_LSA_SEQ);
+}
+
+void pvl_set_lsa_seq(u8 *buf, u32 seq)
+{
+	w32(buf + PVL_OFFSET_LSA_SEQ, seq);
+}
+
+ip_addr pvl_get_lsa_link_addr(const u8 *buf, int i)
+{
+	return r32(buf + PVL_OFFSET_LSA_LINKS + i * PVL_LSA_LINK_SIZE + PVL_OFFSET_LSA_LINK_ADDR);
+}
+
+void pvl_set_lsa_link_addr(u8 *buf, int i, ip_addr addr)
+{
+	w32(buf + PVL_OFFSET_LSA_LINKS + i * PVL_LSA_LINK_SIZE + PVL_OFFSET_LSA_LINK_ADDR, addr);
+}
+
+u32 pvl_get_lsa_link_cost(const u8 *buf, int i)
+{
+	return r32(buf + PVL_OFFSET_LSA_LINKS + i * PVL_LSA_LINK_SIZE + PVL_OFFSET_LSA_LINK_COST);
+}
+
+void pvl_set_lsa_link_cost(u8 *buf, int i, u32 cost)
+{
+	w32(buf + PVL_OFFSET_LSA_LINKS + i * PVL_LSA_LINK_SIZE + PVL_OFFSET_LSA_LINK_COST, cost);
 }
 
 void pvl_set_nack_status(u8 *buf, u32 status)
@@ -236,3 +367,96 @@ u32 pvl_get_nack_status(const u8 *buf)
 {
 	return r32(buf + PVL_OFFSET_NACK_STATUS);
 }
+
+void pvl_set_sack_map(u8 *buf, u64 map)
+{
+	w32(buf + PVL_OFFSET_SACK_MAP, map >> 32);
+	w32(buf + PVL_OFFSET_SACK_MAP + 4, map);
+}
+
+u64 pvl_get_sack_map(const u8 *buf)
+{
+	return ((u64)r32(buf + PVL_OFFSET_SACK_MAP) << 32) |
+		r32(buf + PVL_OFFSET_SACK_MAP + 4);
+}
+
+void pvl_set_mcast_count(u8 *buf, u32 count)
+{
+	w32(buf + PVL_OFFSET_MCAST_COUNT, count);
+}
+
+u32 pvl_get_mcast_count(const u8 *buf)
+{
+	return r32(buf + PVL_OFFSET_MCAST_COUNT);
+}
+
+void pvl_set_mcast_dst(u8 *buf, int i, ip_addr dst)
+{
+	w32(buf + PVL_OFFSET_MCAST_DSTS + 4 * i, dst);
+}
+
+ip_addr pvl_get_mcast_dst(const u8 *buf, int i)
+{
+	return r32(buf + PVL_OFFSET_MCAST_DSTS + 4 * i);
+}
+
+/* The text follows the member list, the length field covers both */
+const char *pvl_get_mcast_data(const u8 *buf)
+{
+	return (const char *)(buf + PVL_OFFSET_MCAST_DSTS +
+		4 * pvl_get_mcast_count(buf));
+}
+
+/* The file size in an offer, the offset of a chunk or the offset the
+   receiver continues at in an ack */
+void pvl_set_file_off(u8 *buf, u32 off)
+{
+	w32(buf + PVL_OFFSET_FILE_OFF, off);
+}
+
+u32 pvl_get_file_off(const u8 *buf)
+{
+	return r32(buf + PVL_OFFSET_FILE_OFF);
+}
+
+void pvl_set_file_data(u8 *buf, const void *data, size_t len)
+{
+	memcpy(buf + PVL_OFFSET_FILE_DATA, data, len);
+}
+
+const u8 *pvl_get_file_data(const u8 *buf)
+{
+	return buf + PVL_OFFSET_FILE_DATA;
+}
+
+void pvl_set_file_sum(u8 *buf, u32 sum)
+{
+	w32(buf + PVL_OFFSET_FILE_SUM, sum);
+}
+
+u32 pvl_get_file_sum(const u8 *buf)
+{
+	return r32(buf + PVL_OFFSET_FILE_SUM);
+}
+
+void pvl_set_file_name(u8 *buf, const char *name, size_t len)
+{
+	memcpy(buf + PVL_OFFSET_FILE_NAME, name, len);
+}
+
+const char *pvl_get_file_name(const u8 *buf)
+{
+	return (const char *)(buf + PVL_OFFSET_FILE_NAME);
+}
+
+/* Pings of older nodes have no payload, they announce no features */
+u32 pvl_get_features(const u8 *buf)
+{
+	return pvl_get_length(buf) >= PVL_FEATURES_SIZE ?
+		r32(buf + PVL_OFFSET_FEATURES) : 0;
+}
+
+void pvl_set_features(u8 *buf, u32 features)
+{
+	w32(buf + PVL_OFFSET_FEATURES, features);
+}
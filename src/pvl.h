@@ -11,6 +11,9 @@
 #define PVL_NACK_HEADER_SIZE   20
 #define PVL_HEADER_SIZE         8
 #define PVL_MSG_HEADER_SIZE    16
+#define PVL_SACK_HEADER_SIZE   24
+#define PVL_MCAST_HEADER_SIZE  20
+#define PVL_FILE_HEADER_SIZE   20
 
 #define PVL_OFFSET_VERSION      0
 #define PVL_OFFSET_MSGTYPE      1
@@ -23,13 +26,59 @@
 #define PVL_OFFSET_TTL         20
 #define PVL_OFFSET_NACK_STATUS 24
 #define PVL_OFFSET_MSG_DATA    24
+#define PVL_OFFSET_SACK_MAP    24
+#define PVL_OFFSET_MCAST_COUNT 24
+#define PVL_OFFSET_MCAST_DSTS  28
+#define PVL_OFFSET_FILE_OFF    24
+#define PVL_OFFSET_FILE_DATA   28
 
-#define PVL_ROUTE_SIZE          8
+/* The data of an offer is the CRC of the whole file and its name */
+#define PVL_FILE_SUM_SIZE       4
+#define PVL_OFFSET_FILE_SUM    28
+#define PVL_OFFSET_FILE_NAME   32
+
+/* Members a PVL_MULTICAST may carry, ahead of its text */
+#define PVL_MCAST_MAX          32
+
+#define PVL_ROUTE_SIZE         16
 
 #define PVL_OFFSET_ROUTE_DST    0
 #define PVL_OFFSET_ROUTE_HOPS   4
+#define PVL_OFFSET_ROUTE_COST   8
+#define PVL_OFFSET_ROUTE_PLEN  12
+
+#define PVL_RT_PART_HEADER_SIZE 8
+#define PVL_RT_PART_ROUTES     48
+
+#define PVL_OFFSET_RT_EPOCH     8
+#define PVL_OFFSET_RT_PART     12
+#define PVL_OFFSET_RT_PARTS    14
+
+#define PVL_LSA_HEADER_SIZE     8
+#define PVL_LSA_LINK_SIZE       8
+
+#define PVL_OFFSET_LSA_ORIGIN   8
+#define PVL_OFFSET_LSA_SEQ     12
+#define PVL_OFFSET_LSA_LINKS   16
+
+#define PVL_OFFSET_LSA_LINK_ADDR 0
+#define PVL_OFFSET_LSA_LINK_COST 4
 
-#define PVL_VERSION             1
+/* Bumped whenever a frame layout changes, a node drops the connection
+   of a neighbour speaking another version. 2 has 16 byte routes with
+   cost and prefix length, flags in the message type and features in
+   pings and pongs. */
+#define PVL_VERSION             2
+
+/* The upper bits of the message type byte carry flags */
+#define PVL_MSGTYPE_MASK     0x3F
+#define PVL_FLAG_CE          0x40
+#define PVL_FLAG_LZ          0x80
+
+/* Features a node announces in the payload of its pings and pongs */
+#define PVL_OFFSET_FEATURES     8
+#define PVL_FEATURES_SIZE       4
+#define PVL_FEAT_LZ             1
 
 #define FOREACH_MSGTYPE(MSGTYPE) \
 	MSGTYPE(PVL_MESSAGE), \
@@ -37,7 +86,14 @@
 	MSGTYPE(PVL_ACK), \
 	MSGTYPE(PVL_NACK), \
 	MSGTYPE(PVL_PING), \
-	MSGTYPE(PVL_PONG) \
+	MSGTYPE(PVL_PONG), \
+	MSGTYPE(PVL_LSA), \
+	MSGTYPE(PVL_ROUTING_PART), \
+	MSGTYPE(PVL_SACK), \
+	MSGTYPE(PVL_MULTICAST), \
+	MSGTYPE(PVL_FILE_OFFER), \
+	MSGTYPE(PVL_FILE_CHUNK), \
+	MSGTYPE(PVL_FILE_ACK) \
 
 typedef enum
 {
@@ -64,6 +120,13 @@ u8 pvl_get_version(const u8 *buf);
 void pvl_set_msgtype(u8 *buf, u8 msgtype);
 u8 pvl_get_msgtype(const u8 *buf);
 
+void pvl_set_flags(u8 *buf, u8 flags);
+void pvl_clear_flags(u8 *buf, u8 flags);
+u8 pvl_get_flags(const u8 *buf);
+
+void pvl_set_features(u8 *buf, u32 features);
+u32 pvl_get_features(const u8 *buf);
+
 void pvl_set_msg_data(u8 *buf, const char *data, size_t len);
 const char *pvl_get_msg_data(const u8 *buf);
 
@@ -73,6 +136,12 @@ void pvl_set_route_dst(u8 *buf, int i, ip_addr dst);
 u32 pvl_get_route_hops(const u8 *buf, int i);
 void pvl_set_route_hops(u8 *buf, int i, u32 hops);
 
+u32 pvl_get_route_cost(const u8 *buf, int i);
+void pvl_set_route_cost(u8 *buf, int i, u32 cost);
+
+u32 pvl_get_route_plen(const u8 *buf, int i);
+void pvl_set_route_plen(u8 *buf, int i, u32 plen);
+
 int pvl_msgtype_valid(PvlMsgType type);
 const char *pvl_msgtype_str(PvlMsgType type);
 int pvl_version_valid(u32 version);
@@ -87,7 +156,49 @@ ip_addr pvl_get_src(const u8 *buf);
 u32 pvl_get_msgid(const u8 *buf);
 u32 pvl_get_ttl(const u8 *buf);
 
+u32 pvl_get_rt_epoch(const u8 *buf);
+void pvl_set_rt_epoch(u8 *buf, u32 epoch);
+
+u16 pvl_get_rt_part(const u8 *buf);
+void pvl_set_rt_part(u8 *buf, u16 part);
+
+u16 pvl_get_rt_parts(const u8 *buf);
+void pvl_set_rt_parts(u8 *buf, u16 parts);
+
+ip_addr pvl_get_lsa_origin(const u8 *buf);
+void pvl_set_lsa_origin(u8 *buf, ip_addr origin);
+
+u32 pvl_get_lsa_seq(const u8 *buf);
+void pvl_set_lsa_seq(u8 *buf, u32 seq);
+
+ip_addr pvl_get_lsa_link_addr(const u8 *buf, int i);
+void pvl_set_lsa_link_addr(u8 *buf, int i, ip_addr addr);
+
+u32 pvl_get_lsa_link_cost(const u8 *buf, int i);
+void pvl_set_lsa_link_cost(u8 *buf, int i, u32 cost);
+
 void pvl_set_nack_status(u8 *buf, u32 status);
 u32 pvl_get_nack_status(const u8 *buf);
 
+void pvl_set_sack_map(u8 *buf, u64 map);
+u64 pvl_get_sack_map(const u8 *buf);
+
+void pvl_set_mcast_count(u8 *buf, u32 count);
+u32 pvl_get_mcast_count(const u8 *buf);
+
+void pvl_set_mcast_dst(u8 *buf, int i, ip_addr dst);
+ip_addr pvl_get_mcast_dst(const u8 *buf, int i);
+
+const char *pvl_get_mcast_data(const u8 *buf);
+
+void pvl_set_file_off(u8 *buf, u32 off);
+u32 pvl_get_file_off(const u8 *buf);
+
+void pvl_set_file_data(u8 *buf, const void *data, size_t len);
+const u8 *pvl_get_file_data(const u8 *buf);
+void pvl_set_file_sum(u8 *buf, u32 sum);
+u32 pvl_get_file_sum(const u8 *buf);
+void pvl_set_file_name(u8 *buf, const char *name, size_t len);
+const char *pvl_get_file_name(const u8 *buf);
+
 #endif
@@ -0,0 +1,92 @@
+#include "ratelimit.h"
+#include "util.h"
+#include <string.h>
+
+#define RL_SCALE 1000000ull
+
+static void tb_init(TokenBucket *tb, u32 burst, u64 now)
+{
+	tb->tokens = burst * RL_SCALE;
+	tb->last = now;
+}
+
+static int tb_take(TokenBucket *tb, u32 rate, u32 burst, u32 bytes, u64 now)
+{
+	u64 max = burst * RL_SCALE, cost = bytes * RL_SCALE;
+	u64 elapsed = now - tb->last;
+	tb->last = now;
+	if(elapsed >= max / rate + 1 || (tb->tokens += elapsed * rate) > max)
+	{
+		tb->tokens = max;
+	}
+
+	if(tb->tokens < cost)
+	{
+		return 0;
+	}
+
+	tb->tokens -= cost;
+	return 1;
+}
+
+void ratetab_init(RateTable *t, size_t cap, u32 rate, u32 burst)
+{
+	t->cap = cap;
+	t->entries = smalloc(cap * sizeof(*t->entries));
+	ratetab_set(t, rate, burst);
+}
+
+void ratetab_free(RateTable *t)
+{
+	sfree(t->entries);
+}
+
+/* Changing the limits starts every bucket over */
+void ratetab_set(RateTable *t, u32 rate, u32 burst)
+{
+	t->rate = rate;
+	t->burst = burst;
+	memset(t->entries, 0, t->cap * sizeof(*t->entries));
+}
+
+static RateEntry *ratetab_get(RateTable *t, ip_addr addr, u64 now)
+{
+	size_t home = (addr * 2654435761u) % t->cap;
+	RateEntry *victim = NULL;
+	for(size_t i = 0; i < RL_PROBE && i < t->cap; ++i)
+	{
+		RateEntry *e = t->entries + (home + i) % t->cap;
+		if(e->addr == addr)
+		{
+			return e;
+		}
+
+		if(!e->addr)
+		{
+			victim = e;
+			break;
+		}
+
+		if(!victim || e->tb.last < victim->tb.last)
+		{
+			victim = e;
+		}
+	}
+
+	victim->addr = addr;
+	tb_init(&victim->tb, t->burst, now);
+	return victim;
+}
+
+/* Returns 1 if bytes fit into the bucket of addr, 0 if over the limit */
+int ratetab_take(RateTable *t, ip_addr addr, u32 bytes, u64 now)
+{
+	RateEntry *e;
+	if(!t->rate)
+	{
+		return 1;
+	}
+
+	e = ratetab_get(t, addr, now);
+	return tb_take(&e->tb, t->rate, t->burst, bytes, now);
+}
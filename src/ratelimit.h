@@ -0,0 +1,38 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include "net_util.h"
+
+#define RL_PROBE 8
+
+/* Token bucket counted in bytes. Tokens are kept scaled by one million
+   so that refilling by rate * elapsed microseconds stays exact. */
+typedef struct
+{
+	u64 tokens;
+	u64 last;
+} TokenBucket;
+
+typedef struct
+{
+	ip_addr addr;
+	TokenBucket tb;
+} RateEntry;
+
+/* Buckets by address in an open addressed table. When all slots within
+   RL_PROBE of the home slot are taken, the bucket idle the longest is
+   recycled. A rate of 0 disables the limit. */
+typedef struct
+{
+	u32 rate;
+	u32 burst;
+	size_t cap;
+	RateEntry *entries;
+} RateTable;
+
+void ratetab_init(RateTable *t, size_t cap, u32 rate, u32 burst);
+void ratetab_free(RateTable *t);
+void ratetab_set(RateTable *t, u32 rate, u32 burst);
+int ratetab_take(RateTable *t, ip_addr addr, u32 bytes, u64 now);
+
+#endif
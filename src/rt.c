@@ -1,35 +1,111 @@
 #include "rt.h"
+#include "simd.h"
 #include "util.h"
+#include <stdlib.h>
 #include <string.h>
 
 void rt_init(RT *rt, size_t max)
 {
+	ip_addr *via;
+	u64 *refreshed;
+	u32 *conn, *path_cost, *path_hops;
 	rt->len = 0;
-	rt->routes = smalloc(max * sizeof(Route));
+	rt->cap = max;
+	rt->gen = 0;
+	rt->dst = smalloc(max * sizeof(*rt->dst));
+	rt->plen = smalloc(max * sizeof(*rt->plen));
+	rt->hops = smalloc(max * sizeof(*rt->hops));
+	rt->cost = smalloc(max * sizeof(*rt->cost));
+	rt->num_via = smalloc(max * sizeof(*rt->num_via));
+	via = smalloc(RT_MAX_PATHS * max * sizeof(*via));
+	refreshed = smalloc(RT_MAX_PATHS * max * sizeof(*refreshed));
+	conn = smalloc(RT_MAX_PATHS * max * sizeof(*conn));
+	path_cost = smalloc(RT_MAX_PATHS * max * sizeof(*path_cost));
+	path_hops = smalloc(RT_MAX_PATHS * max * sizeof(*path_hops));
+	for(u32 k = 0; k < RT_MAX_PATHS; ++k)
+	{
+		rt->via[k] = via + k * max;
+		rt->refreshed[k] = refreshed + k * max;
+		rt->conn[k] = conn + k * max;
+		rt->path_cost[k] = path_cost + k * max;
+		rt->path_hops[k] = path_hops + k * max;
+	}
+
+	trie_init(&rt->trie, max);
+}
+
+void rt_free(RT *rt)
+{
+	sfree(rt->dst);
+	sfree(rt->plen);
+	sfree(rt->hops);
+	sfree(rt->cost);
+	sfree(rt->num_via);
+	sfree(rt->via[0]);
+	sfree(rt->refreshed[0]);
+	sfree(rt->conn[0]);
+	sfree(rt->path_cost[0]);
+	sfree(rt->path_hops[0]);
+	trie_free(&rt->trie);
+}
+
+void rt_clear(RT *rt)
+{
+	rt->len = 0;
+	++rt->gen;
+	trie_clear(&rt->trie);
+}
+
+/* Moves routes [from, from + n) to index to in every column */
+static void rt_move(RT *dst, size_t to, const RT *src, size_t from, size_t n)
+{
+	++dst->gen;
+	memmove(dst->dst + to, src->dst + from, n * sizeof(*dst->dst));
+	memmove(dst->plen + to, src->plen + from, n * sizeof(*dst->plen));
+	memmove(dst->hops + to, src->hops + from, n * sizeof(*dst->hops));
+	memmove(dst->cost + to, src->cost + from, n * sizeof(*dst->cost));
+	memmove(dst->num_via + to, src->num_via + from, n * sizeof(*dst->num_via));
+	for(u32 k = 0; k < RT_MAX_PATHS; ++k)
+	{
+		memmove(dst->via[k] + to, src->via[k] + from, n * sizeof(**dst->via));
+		memmove(dst->refreshed[k] + to, src->refreshed[k] + from,
+			n * sizeof(**dst->refreshed));
+		memmove(dst->conn[k] + to, src->conn[k] + from,
+			n * sizeof(**dst->conn));
+		memmove(dst->path_cost[k] + to, src->path_cost[k] + from,
+			n * sizeof(**dst->path_cost));
+		memmove(dst->path_hops[k] + to, src->path_hops[k] + from,
+			n * sizeof(**dst->path_hops));
+	}
 }
 
 void rt_copy(RT *dst, RT *src)
 {
 	dst->len = src->len;
-	memcpy(dst->routes, src->routes, dst->len * sizeof(Route));
+	rt_move(dst, 0, src, 0, src->len);
+	trie_copy(&dst->trie, &src->trie);
 }
 
 int rt_equals(RT *a, RT *b)
 {
-	if(a->len != b->len)
+	size_t n = a->len;
+	if(n != b->len)
 	{
 		return 0;
 	}
 
-	for(size_t i = 0; i < a->len; ++i)
+	if(!simd_equal_u32(a->dst, b->dst, n) ||
+		!simd_equal_u32(a->plen, b->plen, n) ||
+		!simd_equal_u32(a->hops, b->hops, n) ||
+		!simd_equal_u32(a->cost, b->cost, n) ||
+		!simd_equal_u32(a->num_via, b->num_via, n))
 	{
-		Route *x, *y;
-		x = a->routes + i;
-		y = b->routes + i;
+		return 0;
+	}
 
-		if(x->dst != y->dst ||
-			x->via != y->via ||
-			x->hops != y->hops)
+	for(u32 k = 0; k < RT_MAX_PATHS; ++k)
+	{
+		if(!simd_equal_u32(a->via[k], b->via[k], n))
 		{
 			return 0;
 		}
@@ -38,87 +114,543 @@ int rt_equals(RT *a, RT *b)
 	return 1;
 }
 
-void rt_free(RT *rt)
+void rt_get(const RT *rt, size_t i, Route *out)
 {
-	sfree(rt->routes);
+	out->dst = rt->dst[i];
+	out->plen = rt->plen[i];
+	out->hops = rt->hops[i];
+	out->cost = rt->cost[i];
+	out->num_via = rt->num_via[i];
+	for(u32 k = 0; k < RT_MAX_PATHS; ++k)
+	{
+		out->via[k] = rt->via[k][i];
+		out->refreshed[k] = rt->refreshed[k][i];
+		out->conn[k] = rt->conn[k][i];
+		out->path_cost[k] = rt->path_cost[k][i];
+		out->path_hops[k] = rt->path_hops[k][i];
+	}
 }
 
-ip_addr rt_get_via(RT *rt, ip_addr dst)
+static void rt_put(RT *rt, size_t i, const Route *r)
 {
+	if(i >= rt->len || rt->dst[i] != r->dst || rt->plen[i] != r->plen ||
+		rt->hops[i] != r->hops || rt->cost[i] != r->cost)
+	{
+		++rt->gen;
+	}
+
+	rt->dst[i] = r->dst;
+	rt->plen[i] = r->plen;
+	rt->hops[i] = r->hops;
+	rt->cost[i] = r->cost;
+	rt->num_via[i] = r->num_via;
+	for(u32 k = 0; k < RT_MAX_PATHS; ++k)
+	{
+		rt->via[k][i] = k < r->num_via ? r->via[k] : 0;
+		rt->refreshed[k][i] = k < r->num_via ? r->refreshed[k] : 0;
+		rt->conn[k][i] = k < r->num_via ? r->conn[k] : 0;
+		rt->path_cost[k][i] = k < r->num_via ? r->path_cost[k] : 0;
+		rt->path_hops[k][i] = k < r->num_via ? r->path_hops[k] : 0;
+	}
+}
+
+/* Compaction moves routes around, so the index is rebuilt afterwards */
+static void rt_reindex(RT *rt)
+{
+	trie_clear(&rt->trie);
 	for(size_t i = 0; i < rt->len; ++i)
 	{
-		if(rt->routes[i].dst == dst)
+		trie_insert(&rt->trie, rt->dst[i], rt->plen[i], i);
+	}
+}
+
+size_t rt_find_prefix(RT *rt, ip_addr dst, u32 plen)
+{
+	u32 idx = trie_find(&rt->trie, dst, plen);
+	return idx == TRIE_NIL ? RT_NONE : idx;
+}
+
+size_t rt_find(RT *rt, ip_addr dst)
+{
+	return rt_find_prefix(rt, dst, 32);
+}
+
+size_t rt_lookup(RT *rt, ip_addr addr)
+{
+	u32 idx = trie_lookup(&rt->trie, addr);
+	return idx == TRIE_NIL ? RT_NONE : idx;
+}
+
+ip_addr rt_get_via(RT *rt, ip_addr dst)
+{
+	size_t i = rt_lookup(rt, dst);
+	return i == RT_NONE ? 0 : rt->via[0][i];
+}
+
+static u32 rt_hash(u32 a, u32 b, u32 c)
+{
+	u32 h = 2166136261u;
+	h = (h ^ a) * 16777619u;
+	h = (h ^ b) * 16777619u;
+	h = (h ^ c) * 16777619u;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	return h;
+}
+
+/* Picks one of the equal cost next hops by highest random weight, so a
+   (src, dst) flow sticks to one path and only the flows of a failed
+   next hop move when it is removed. The connection bound to the chosen
+   path is returned in conn. */
+ip_addr rt_get_hop_flow(RT *rt, ip_addr src, ip_addr dst, u32 *conn)
+{
+	size_t i;
+	u32 best, path = 0;
+	if((i = rt_lookup(rt, dst)) == RT_NONE)
+	{
+		*conn = 0;
+		return 0;
+	}
+
+	best = rt_hash(src, dst, rt->via[0][i]);
+	for(u32 k = 1; k < rt->num_via[i]; ++k)
+	{
+		u32 w = rt_hash(src, dst, rt->via[k][i]);
+		if(w > best)
 		{
-			return rt->routes[i].via;
+			best = w;
+			path = k;
 		}
 	}
 
-	return 0;
+	*conn = rt->conn[path][i];
+	return rt->via[path][i];
 }
 
-Route *rt_find(RT *rt, ip_addr dst)
+ip_addr rt_get_via_flow(RT *rt, ip_addr src, ip_addr dst)
 {
-	for(size_t i = 0; i < rt->len; ++i)
+	u32 conn;
+	return rt_get_hop_flow(rt, src, dst, &conn);
+}
+
+/* Binds every path through via to conn */
+void rt_bind(RT *rt, ip_addr via, u32 conn)
+{
+	size_t len = rt->len;
+	for(u32 k = 0; k < RT_MAX_PATHS; ++k)
 	{
-		if(rt->routes[i].dst == dst)
+		const u32 *col = rt->via[k];
+		size_t i = simd_find_u32(col, len, via);
+		while(i < len)
 		{
-			return rt->routes + i;
+			rt->conn[k][i] = conn;
+			++i;
+			i += simd_find_u32(col + i, len - i, via);
 		}
 	}
+}
 
-	return NULL;
+/* A route through a different next hop must be cheaper by more than
+   RT_HYSTERESIS_PCT to replace the current one, so that jittery link
+   costs do not make routes flap between neighbours. */
+static int rt_better(const Route *re, const Route *ins)
+{
+	if(ins->cost == re->cost)
+	{
+		return ins->hops < re->hops;
+	}
+
+	return (u64)ins->cost * 100 < (u64)re->cost * (100 - RT_HYSTERESIS_PCT);
 }
 
-void rt_add(RT *rt, Route *ins)
+/* Paths whose cost lies within the hysteresis band count as equal */
+static int rt_equal_cost(const Route *re, const Route *ins)
+{
+	u32 diff = ins->cost > re->cost ?
+		ins->cost - re->cost : re->cost - ins->cost;
+	return (u64)diff * 100 <= (u64)re->cost * RT_HYSTERESIS_PCT;
+}
+
+static void rt_remove_path(Route *re, u32 k)
+{
+	--re->num_via;
+	for(; k < re->num_via; ++k)
+	{
+		re->via[k] = re->via[k + 1];
+		re->refreshed[k] = re->refreshed[k + 1];
+		re->conn[k] = re->conn[k + 1];
+		re->path_cost[k] = re->path_cost[k + 1];
+		re->path_hops[k] = re->path_hops[k + 1];
+	}
+}
+
+/* Restores the invariants after a path cost changed: a path cheaper
+   than path 0 by more than the hysteresis becomes path 0, and the
+   other paths must stay within the equal cost band of it. Without keep,
+   path 0 has no claim to stay and the cheapest path takes its place. */
+static void rt_settle(Route *re, int keep)
+{
+	u32 best = 0, k;
+	for(k = 1; k < re->num_via; ++k)
+	{
+		if(re->path_cost[k] < re->path_cost[best])
+		{
+			best = k;
+		}
+	}
+
+	if(best && (!keep || (u64)re->path_cost[best] * 100 <
+		(u64)re->path_cost[0] * (100 - RT_HYSTERESIS_PCT)))
+	{
+		ip_addr via = re->via[0];
+		u64 refreshed = re->refreshed[0];
+		u32 conn = re->conn[0], cost = re->path_cost[0];
+		u32 hops = re->path_hops[0];
+		re->via[0] = re->via[best];
+		re->refreshed[0] = re->refreshed[best];
+		re->conn[0] = re->conn[best];
+		re->path_cost[0] = re->path_cost[best];
+		re->path_hops[0] = re->path_hops[best];
+		re->via[best] = via;
+		re->refreshed[best] = refreshed;
+		re->conn[best] = conn;
+		re->path_cost[best] = cost;
+		re->path_hops[best] = hops;
+	}
+
+	re->cost = re->path_cost[0];
+	re->hops = re->path_hops[0];
+	k = 1;
+	while(k < re->num_via)
+	{
+		u32 c = re->path_cost[k];
+		u32 diff = c > re->cost ? c - re->cost : re->cost - c;
+		if((u64)diff * 100 > (u64)re->cost * RT_HYSTERESIS_PCT)
+		{
+			rt_remove_path(re, k);
+		}
+		else
+		{
+			++k;
+		}
+	}
+}
+
+/* A path that is already known is refreshed in place, so that a
+   neighbour repeating its table leaves the order of the paths alone */
+static void rt_merge(Route *re, const Route *ins)
 {
-	Route *re;
-	if((re = rt_find(rt, ins->dst)))
+	for(u32 k = 0; k < re->num_via; ++k)
 	{
-		if(re->hops > ins->hops)
+		if(re->via[k] == ins->via[0])
 		{
-			*re = *ins;
+			re->refreshed[k] = ins->refreshed[0];
+			re->conn[k] = ins->conn[0];
+			re->path_cost[k] = ins->cost;
+			re->path_hops[k] = ins->hops;
+			rt_settle(re, 1);
+			return;
 		}
+	}
+
+	if(rt_better(re, ins))
+	{
+		*re = *ins;
+	}
+	else if(re->num_via < RT_MAX_PATHS && re->via[0] != re->dst &&
+		rt_equal_cost(re, ins))
+	{
+		re->refreshed[re->num_via] = ins->refreshed[0];
+		re->conn[re->num_via] = ins->conn[0];
+		re->path_cost[re->num_via] = ins->cost;
+		re->path_hops[re->num_via] = ins->hops;
+		re->via[re->num_via++] = ins->via[0];
+	}
+}
+
+void rt_add(RT *rt, Route *ins)
+{
+	size_t i;
+	for(u32 k = 0; k < ins->num_via; ++k)
+	{
+		ins->path_cost[k] = ins->cost;
+		ins->path_hops[k] = ins->hops;
+	}
+
+	if((i = rt_find_prefix(rt, ins->dst, ins->plen)) != RT_NONE)
+	{
+		Route re;
+		rt_get(rt, i, &re);
+		rt_merge(&re, ins);
+		rt_put(rt, i, &re);
 		return;
 	}
 
-	rt->routes[rt->len++] = *ins;
+	if(rt->len >= rt->cap)
+	{
+		return;
+	}
+
+	if(trie_insert(&rt->trie, ins->dst, ins->plen, rt->len))
+	{
+		return;
+	}
+
+	rt_put(rt, rt->len, ins);
+	++rt->len;
 }
 
-void rt_add_direct(RT *rt, ip_addr ip)
+void rt_add_direct(RT *rt, ip_addr ip, u32 cost)
 {
 	Route ins;
 	ins.dst = ip;
-	ins.via = ip;
+	ins.plen = 32;
 	ins.hops = 1;
+	ins.cost = cost;
+	ins.num_via = 1;
+	ins.via[0] = ip;
+	ins.refreshed[0] = 0;
+	ins.conn[0] = 0;
 	rt_add(rt, &ins);
 }
 
-static int rt_filter_via(void *elem, const void *data)
+/* Removes path k of route i. The paths left are settled again, so
+   cost and hops are those of a path that still exists; when path 0 goes,
+   the cheapest one left replaces it. Since a next hop
+   appears at most once per route, callers scanning for one via can go
+   on with the next route. */
+static void rt_drop_path(RT *rt, size_t i, u32 k)
 {
-	ip_addr ip = *(const ip_addr *)data;
-	const Route *cur = elem;
-	return cur->via == cur->dst || cur->via != ip;
+	Route re;
+	rt_get(rt, i, &re);
+	rt_remove_path(&re, k);
+	if(re.num_via)
+	{
+		rt_settle(&re, k != 0);
+	}
+
+	rt_put(rt, i, &re);
 }
 
-void rt_remove_via(RT *rt, ip_addr via)
+/* Removes routes without paths left. Runs of surviving routes are moved
+   with one memmove per column. */
+static void rt_compact(RT *rt)
+{
+	size_t len = rt->len, w, r;
+	w = simd_find_u32(rt->num_via, len, 0);
+	r = w;
+	while(r < len)
+	{
+		size_t end;
+		while(r < len && !rt->num_via[r])
+		{
+			++r;
+		}
+
+		if(r >= len)
+		{
+			break;
+		}
+
+		end = r + simd_find_u32(rt->num_via + r, len - r, 0);
+		rt_move(rt, w, rt, r, end - r);
+		w += end - r;
+		r = end;
+	}
+
+	if(w != len)
+	{
+		rt->len = w;
+		rt_reindex(rt);
+	}
+}
+
+/* Drops every path through via; a direct route to via itself is only
+   dropped if keep_direct is 0 */
+static void rt_filter_via(RT *rt, ip_addr via, int keep_direct)
 {
-	rt->len = filter(
-		rt->routes, rt->len,
-		sizeof(*rt->routes), &via,
-		rt_filter_via);
+	size_t len = rt->len;
+	for(u32 k = 0; k < RT_MAX_PATHS; ++k)
+	{
+		const u32 *col = rt->via[k];
+		size_t i = simd_find_u32(col, len, via);
+		while(i < len)
+		{
+			if(!keep_direct || rt->dst[i] != via)
+			{
+				rt_drop_path(rt, i, k);
+			}
+
+			++i;
+			i += simd_find_u32(col + i, len - i, via);
+		}
+	}
+
+	rt_compact(rt);
 }
 
-static int rt_filter_disconn(void *elem, const void *data)
+void rt_remove_via(RT *rt, ip_addr via)
 {
-	ip_addr ip = *(const ip_addr *)data;
-	const Route *cur = elem;
-	return cur->via != ip;
+	rt_filter_via(rt, via, 1);
 }
 
 void rt_remove_disconn(RT *rt, ip_addr via)
 {
-	rt->len = filter(
-		rt->routes, rt->len,
-		sizeof(*rt->routes), &via,
-		rt_filter_disconn);
+	rt_filter_via(rt, via, 0);
+}
+
+/* Drops the paths through via that were last refreshed before
+   refreshed, except the direct route to via */
+void rt_remove_stale(RT *rt, ip_addr via, u64 refreshed)
+{
+	for(size_t i = 0; i < rt->len; ++i)
+	{
+		u32 k = 0;
+		while(k < rt->num_via[i])
+		{
+			if(rt->via[k][i] == via && rt->dst[i] != via &&
+				rt->refreshed[k][i] < refreshed)
+			{
+				/* Settling may have reordered the paths */
+				rt_drop_path(rt, i, k);
+				k = 0;
+			}
+			else
+			{
+				++k;
+			}
+		}
+	}
+
+	rt_compact(rt);
+}
+
+/* Direct routes live as long as the connection and never expire */
+void rt_expire(RT *rt, u64 deadline)
+{
+	for(size_t i = 0; i < rt->len; ++i)
+	{
+		u32 k = 0;
+		while(k < rt->num_via[i])
+		{
+			if(rt->via[k][i] != rt->dst[i] && rt->refreshed[k][i] < deadline)
+			{
+				/* Settling may have reordered the paths */
+				rt_drop_path(rt, i, k);
+				k = 0;
+			}
+			else
+			{
+				++k;
+			}
+		}
+	}
+
+	rt_compact(rt);
+}
+
+static int rt_cmp_prefix(const void *a, const void *b)
+{
+	const Route *x = a, *y = b;
+	if(x->dst != y->dst)
+	{
+		return x->dst < y->dst ? -1 : 1;
+	}
+
+	return (x->plen > y->plen) - (x->plen < y->plen);
+}
+
+static int rt_siblings(const Route *a, const Route *b)
+{
+	ip_addr bit;
+	if(a->plen != b->plen || !a->plen)
+	{
+		return 0;
+	}
+
+	bit = 1u << (32 - a->plen);
+	return !(a->dst & bit) && (a->dst ^ b->dst) == bit;
+}
+
+/* Writes the table to out with complete blocks of sibling prefixes merged
+   into their covering prefix, taking the worst metric of the block. Host
+   routes are written as they are, since hosts are only listed by their
+   /32, and no block is merged into a prefix that covers except, the
+   neighbour the table is meant for. Returns the number of entries. */
+size_t rt_aggregate(RT *rt, Route *out, ip_addr except)
+{
+	size_t n = 0, num_prefixes = 0, hosts;
+	for(size_t i = 0; i < rt->len; ++i)
+	{
+		if(rt->plen[i] != 32)
+		{
+			rt_get(rt, i, out + num_prefixes++);
+		}
+	}
+
+	qsort(out, num_prefixes, sizeof(Route), rt_cmp_prefix);
+	for(size_t i = 0; i < num_prefixes; ++i)
+	{
+		out[n++] = out[i];
+		while(n >= 2)
+		{
+			Route *a = out + n - 2, *b = out + n - 1;
+			if(a->dst == b->dst && a->plen == b->plen)
+			{
+				a->cost = a->cost < b->cost ? a->cost : b->cost;
+				a->hops = a->hops < b->hops ? a->hops : b->hops;
+			}
+			else if(rt_siblings(a, b) &&
+				(except & ip_mask(a->plen - 1)) != a->dst)
+			{
+				--a->plen;
+				a->cost = a->cost > b->cost ? a->cost : b->cost;
+				a->hops = a->hops > b->hops ? a->hops : b->hops;
+			}
+			else
+			{
+				break;
+			}
+
+			--n;
+		}
+	}
+
+	hosts = n;
+	for(size_t i = 0; i < rt->len; ++i)
+	{
+		if(rt->plen[i] == 32)
+		{
+			rt_get(rt, i, out + hosts++);
+		}
+	}
+
+	return hosts;
+}
+
+/* Moves the cost of every path through via by the change of its link
+   cost. Secondary paths that leave the equal cost band are dropped. */
+void rt_set_link_cost(RT *rt, ip_addr via, u32 prev, u32 cost)
+{
+	for(size_t i = 0; i < rt->len; ++i)
+	{
+		Route re;
+		int found = 0;
+		rt_get(rt, i, &re);
+		for(u32 k = 0; k < re.num_via; ++k)
+		{
+			if(re.via[k] == via)
+			{
+				re.path_cost[k] = re.path_cost[k] - prev + cost;
+				found = 1;
+			}
+		}
+
+		if(found)
+		{
+			rt_settle(&re, 1);
+			rt_put(rt, i, &re);
+		}
+	}
 }
@@ -2,29 +2,73 @@
 #define __RT_H__
 
 #include "net_util.h"
+#include "trie.h"
+
+#define RT_HYSTERESIS_PCT  10
+#define RT_MAX_PATHS        4
+#define RT_NONE            ((size_t)-1)
+
+#define RT_REFRESH_INTERVAL 10000
+#define RT_SWEEP_INTERVAL    1000
+#define RT_EXPIRE_TIME      35000
 
 typedef struct
 {
 	ip_addr dst;
-	ip_addr via;
+	u32 plen;
 	u32 hops;
+	u32 cost;
+	u32 num_via;
+	ip_addr via[RT_MAX_PATHS];
+	u64 refreshed[RT_MAX_PATHS];
+	u32 conn[RT_MAX_PATHS];
+	u32 path_cost[RT_MAX_PATHS];
+	u32 path_hops[RT_MAX_PATHS];
 } Route;
 
+/* Structure of arrays, so that bulk operations scan one column at a
+   time. Unused via slots are kept zero. conn caches the connection a
+   path's next hop is reached through, 0 if it has not been bound yet.
+   cost and hops are those of path 0, path_cost and path_hops those of
+   every path. gen changes whenever what is advertised changes or routes
+   move, so a reader cutting the table into parts can tell. */
 typedef struct
 {
-	size_t len;
-	Route *routes;
+	size_t len, cap;
+	u32 gen;
+	ip_addr *dst;
+	u32 *plen;
+	u32 *hops;
+	u32 *cost;
+	u32 *num_via;
+	ip_addr *via[RT_MAX_PATHS];
+	u64 *refreshed[RT_MAX_PATHS];
+	u32 *conn[RT_MAX_PATHS];
+	u32 *path_cost[RT_MAX_PATHS];
+	u32 *path_hops[RT_MAX_PATHS];
+	Trie trie;
 } RT;
 
 void rt_copy(RT *dst, RT *src);
 int rt_equals(RT *a, RT *b);
 void rt_init(RT *rt, size_t max);
 void rt_free(RT *rt);
-Route *rt_find(RT *rt, ip_addr dst);
+void rt_clear(RT *rt);
+void rt_get(const RT *rt, size_t i, Route *out);
+size_t rt_find(RT *rt, ip_addr dst);
+size_t rt_find_prefix(RT *rt, ip_addr dst, u32 plen);
+size_t rt_lookup(RT *rt, ip_addr addr);
 ip_addr rt_get_via(RT *rt, ip_addr dst);
+ip_addr rt_get_via_flow(RT *rt, ip_addr src, ip_addr dst);
+ip_addr rt_get_hop_flow(RT *rt, ip_addr src, ip_addr dst, u32 *conn);
+void rt_bind(RT *rt, ip_addr via, u32 conn);
 void rt_add(RT *rt, Route *ins);
-void rt_add_direct(RT *rt, ip_addr ip);
+void rt_add_direct(RT *rt, ip_addr ip, u32 cost);
 void rt_remove_via(RT *rt, ip_addr via);
+void rt_remove_stale(RT *rt, ip_addr via, u64 refreshed);
 void rt_remove_disconn(RT *rt, ip_addr via);
+void rt_expire(RT *rt, u64 deadline);
+size_t rt_aggregate(RT *rt, Route *out, ip_addr except);
+void rt_set_link_cost(RT *rt, ip_addr via, u32 prev, u32 cost);
 
 #endif
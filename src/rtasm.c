@@ -0,0 +1,62 @@
+#include "rtasm.h"
+#include "pvl.h"
+#include "util.h"
+#include <string.h>
+
+/* Collects the parts of one paginated routing table. A part of a newer
+   epoch discards an incomplete older table. */
+
+void rtasm_init(RtAsm *a)
+{
+	memset(a, 0, sizeof(*a));
+}
+
+void rtasm_free(RtAsm *a)
+{
+	sfree(a->have);
+	sfree(a->routes);
+	rtasm_init(a);
+}
+
+static void rtasm_start(RtAsm *a, u32 epoch, u32 parts)
+{
+	rtasm_free(a);
+	a->epoch = epoch;
+	a->parts = parts;
+	a->have = scalloc(parts);
+	a->routes = smalloc(parts * PVL_RT_PART_ROUTES * sizeof(Route));
+}
+
+/* Returns 1 once every part of the table has arrived; the table is then
+   in a->routes[0 .. a->len) */
+int rtasm_part(RtAsm *a, u32 epoch, u32 part, u32 parts,
+	const Route *routes, size_t count, size_t max_parts)
+{
+	size_t base;
+	if(!parts || parts > max_parts || part >= parts ||
+		count > PVL_RT_PART_ROUTES ||
+		(part < parts - 1 && count != PVL_RT_PART_ROUTES))
+	{
+		return 0;
+	}
+
+	if(!a->have || a->epoch != epoch || a->parts != parts)
+	{
+		rtasm_start(a, epoch, parts);
+	}
+
+	if(a->have[part])
+	{
+		return 0;
+	}
+
+	base = (size_t)part * PVL_RT_PART_ROUTES;
+	memcpy(a->routes + base, routes, count * sizeof(Route));
+	if(part == parts - 1)
+	{
+		a->len = base + count;
+	}
+
+	a->have[part] = 1;
+	return ++a->received == a->parts;
+}
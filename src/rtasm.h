@@ -0,0 +1,21 @@
+#ifndef __RTASM_H__
+#define __RTASM_H__
+
+#include "rt.h"
+
+typedef struct
+{
+	u32 epoch;
+	u32 parts;
+	u32 received;
+	u8 *have;
+	Route *routes;
+	size_t len;
+} RtAsm;
+
+void rtasm_init(RtAsm *a);
+void rtasm_free(RtAsm *a);
+int rtasm_part(RtAsm *a, u32 epoch, u32 part, u32 parts,
+	const Route *routes, size_t count, size_t max_parts);
+
+#endif
@@ -0,0 +1,207 @@
+#include "rxwin.h"
+#include "util.h"
+#include <string.h>
+
+/* Records msgid. Ids far behind the window mean the source restarted
+   with a new random start, the window then begins anew. */
+int rxwin_update(RxWin *w, u32 msgid)
+{
+	u32 d;
+	if(!w->map)
+	{
+		w->top = msgid;
+		w->map = 1;
+		return RX_IN_ORDER;
+	}
+
+	d = msgid - w->top;
+	if(d && d < 0x80000000)
+	{
+		w->map = d < RX_WINDOW ? (w->map << d) | 1 : 1;
+		w->top = msgid;
+		return d == 1 ? RX_IN_ORDER : RX_OUT_OF_ORDER;
+	}
+
+	d = w->top - msgid;
+	if(d >= RX_RESYNC)
+	{
+		w->top = msgid;
+		w->map = 1;
+		return RX_IN_ORDER;
+	}
+
+	if(d >= RX_WINDOW)
+	{
+		return RX_TOO_OLD;
+	}
+
+	if((w->map >> d) & 1)
+	{
+		return RX_DUPLICATE;
+	}
+
+	w->map |= (u64)1 << d;
+	return RX_OUT_OF_ORDER;
+}
+
+void rxtab_init(RxTab *tab, size_t max)
+{
+	tab->len = 0;
+	tab->cap = max;
+	tab->peers = smalloc(max * sizeof(*tab->peers));
+	trie_init(&tab->index, max);
+}
+
+void rxtab_free(RxTab *tab)
+{
+	for(size_t i = 0; i < tab->len; ++i)
+	{
+		RxPeer *p = tab->peers + i;
+		if(p->held)
+		{
+			for(u32 j = 0; j < RX_REORDER; ++j)
+			{
+				sfree(p->held[j].text);
+			}
+
+			sfree(p->held);
+		}
+	}
+
+	sfree(tab->peers);
+	trie_free(&tab->index);
+}
+
+/* Returns the state kept for src, NULL if the table is full */
+RxPeer *rxtab_peer(RxTab *tab, ip_addr src)
+{
+	RxPeer *p;
+	u32 idx = trie_find(&tab->index, src, 32);
+	if(idx != TRIE_NIL)
+	{
+		return tab->peers + idx;
+	}
+
+	if(tab->len >= tab->cap || trie_insert(&tab->index, src, 32, tab->len))
+	{
+		return NULL;
+	}
+
+	p = tab->peers + tab->len++;
+	p->src = src;
+	p->win.top = 0;
+	p->win.map = 0;
+	p->unacked = 0;
+	p->ce = 0;
+	p->ack_due = 0;
+	p->ordered = 0;
+	p->next = 0;
+	p->num_held = 0;
+	p->gap_due = 0;
+	p->held = NULL;
+	return p;
+}
+
+/* Hands out the held messages that follow next without a gap */
+static void rxpeer_drain(RxPeer *p, u64 now, RxDeliver cb)
+{
+	RxHeld *h;
+	while(p->num_held && (h = p->held + p->next % RX_REORDER)->text &&
+		h->msgid == p->next)
+	{
+		cb(p->src, h->len, h->text);
+		sfree(h->text);
+		h->text = NULL;
+		--p->num_held;
+		++p->next;
+	}
+
+	p->gap_due = p->num_held ? now + RX_GAP_SKIP : 0;
+}
+
+/* Gives up on the gap at next and moves on to the first held message */
+static void rxpeer_skip(RxPeer *p, u64 now, RxDeliver cb)
+{
+	while(p->num_held)
+	{
+		RxHeld *h = p->held + p->next % RX_REORDER;
+		if(h->text && h->msgid == p->next)
+		{
+			break;
+		}
+
+		++p->next;
+	}
+
+	rxpeer_drain(p, now, cb);
+}
+
+/* Takes a new message, the duplicates were filtered by its RxWin */
+void rxpeer_deliver(RxPeer *p, u32 msgid, const char *text, u32 len,
+	u64 now, RxDeliver cb)
+{
+	RxHeld *h;
+	u32 d;
+	if(!p->ordered || (msgid - p->next >= RX_RESYNC &&
+		p->next - msgid >= RX_RESYNC))
+	{
+		/* First message or the source restarted */
+		while(p->num_held)
+		{
+			rxpeer_skip(p, now, cb);
+		}
+
+		p->ordered = 1;
+		p->next = msgid;
+	}
+
+	d = msgid - p->next;
+	if(d >= 0x80000000)
+	{
+		/* Arrived after its gap was skipped */
+		cb(p->src, len, text);
+		return;
+	}
+
+	while(d >= RX_REORDER)
+	{
+		rxpeer_skip(p, now, cb);
+		if(!p->num_held)
+		{
+			p->next = msgid - RX_REORDER + 1;
+		}
+
+		d = msgid - p->next;
+	}
+
+	if(!d)
+	{
+		cb(p->src, len, text);
+		++p->next;
+		rxpeer_drain(p, now, cb);
+		return;
+	}
+
+	if(!p->held)
+	{
+		p->held = scalloc(RX_REORDER * sizeof(*p->held));
+	}
+
+	h = p->held + msgid % RX_REORDER;
+	h->msgid = msgid;
+	h->len = len;
+	h->text = smalloc(len ? len : 1);
+	memcpy(h->text, text, len);
+	if(!p->num_held++)
+	{
+		p->gap_due = now + RX_GAP_SKIP;
+	}
+}
+
+void rxpeer_timers(RxPeer *p, u64 now, RxDeliver cb)
+{
+	if(p->num_held && now >= p->gap_due)
+	{
+		rxpeer_skip(p, now, cb);
+	}
+}
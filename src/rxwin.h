@@ -0,0 +1,76 @@
+#ifndef __RXWIN_H__
+#define __RXWIN_H__
+
+#include "net_util.h"
+#include "trie.h"
+
+#define RX_WINDOW            64
+#define RX_RESYNC          4096
+#define RX_ACK_EVERY          8
+#define RX_ACK_DELAY     100000
+#define RX_REORDER           32
+#define RX_GAP_SKIP     2000000
+
+enum
+{
+	RX_IN_ORDER,
+	RX_OUT_OF_ORDER,
+	RX_DUPLICATE,
+	RX_TOO_OLD
+};
+
+/* The ids received from one source: top is the highest, bit i of map
+   is set if top - i was received. An empty map means nothing yet. */
+typedef struct
+{
+	u32 top;
+	u64 map;
+} RxWin;
+
+typedef struct
+{
+	u32 msgid;
+	u32 len;
+	char *text;
+} RxHeld;
+
+/* Messages are handed out in id order starting at next. Those that
+   arrive ahead of a gap are held, for at most RX_GAP_SKIP before the
+   gap is given up on. The sender repairs a gap within a round trip by
+   fast retransmit once later messages are acknowledged, otherwise on its
+   timeout, so RX_GAP_SKIP covers twice TX_RTO_INIT. held is allocated
+   on the first gap. */
+typedef struct
+{
+	ip_addr src;
+	RxWin win;
+	u32 unacked;
+	int ce;
+	u64 ack_due;
+	int ordered;
+	u32 next;
+	u32 num_held;
+	u64 gap_due;
+	RxHeld *held;
+} RxPeer;
+
+typedef void (*RxDeliver)(ip_addr src, u32 len, const char *text);
+
+typedef struct
+{
+	size_t len, cap;
+	RxPeer *peers;
+	Trie index;
+} RxTab;
+
+int rxwin_update(RxWin *w, u32 msgid);
+
+void rxtab_init(RxTab *tab, size_t max);
+void rxtab_free(RxTab *tab);
+RxPeer *rxtab_peer(RxTab *tab, ip_addr src);
+
+void rxpeer_deliver(RxPeer *p, u32 msgid, const char *text, u32 len,
+	u64 now, RxDeliver cb);
+void rxpeer_timers(RxPeer *p, u64 now, RxDeliver cb);
+
+#endif
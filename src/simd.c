@@ -0,0 +1,125 @@
+#include "simd.h"
+
+/* The AVX2 kernels are compiled for that target on their own and picked
+   at run time, so default builds use them on CPUs that have AVX2 */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_AVX2 1
+#endif
+
+#if defined(SIMD_AVX2) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Bulk scans over u32 columns. The vector loops handle whole blocks,
+   the scalar loops the tail and targets without SSE2. */
+
+static size_t find_scalar(const u32 *a, size_t i, size_t n, u32 v)
+{
+	for(; i < n; ++i)
+	{
+		if(a[i] == v)
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+static int equal_scalar(const u32 *a, const u32 *b, size_t i, size_t n)
+{
+	for(; i < n; ++i)
+	{
+		if(a[i] != b[i])
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+#ifdef SIMD_AVX2
+__attribute__((target("avx2")))
+static size_t find_avx2(const u32 *a, size_t n, u32 v)
+{
+	size_t i = 0;
+	__m256i key = _mm256_set1_epi32((int)v);
+	for(; i + 8 <= n; i += 8)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(x, key));
+		if(mask)
+		{
+			return i + __builtin_ctz(mask) / 4;
+		}
+	}
+
+	return find_scalar(a, i, n, v);
+}
+
+__attribute__((target("avx2")))
+static int equal_avx2(const u32 *a, const u32 *b, size_t n)
+{
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)) != -1)
+		{
+			return 0;
+		}
+	}
+
+	return equal_scalar(a, b, i, n);
+}
+#endif
+
+/* Returns the index of the first element equal to v, or n */
+size_t simd_find_u32(const u32 *a, size_t n, u32 v)
+{
+	size_t i = 0;
+#ifdef SIMD_AVX2
+	if(__builtin_cpu_supports("avx2"))
+	{
+		return find_avx2(a, n, v);
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i key = _mm_set1_epi32((int)v);
+	for(; i + 4 <= n; i += 4)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(x, key));
+		if(mask)
+		{
+			return i + __builtin_ctz(mask) / 4;
+		}
+	}
+#endif
+	return find_scalar(a, i, n, v);
+}
+
+int simd_equal_u32(const u32 *a, const u32 *b, size_t n)
+{
+	size_t i = 0;
+#ifdef SIMD_AVX2
+	if(__builtin_cpu_supports("avx2"))
+	{
+		return equal_avx2(a, b, n);
+	}
+#endif
+#if defined(__SSE2__)
+	for(; i + 4 <= n; i += 4)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi32(x, y)) != 0xFFFF)
+		{
+			return 0;
+		}
+	}
+#endif
+	return equal_scalar(a, b, i, n);
+}
@@ -0,0 +1,9 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include "types.h"
+
+size_t simd_find_u32(const u32 *a, size_t n, u32 v);
+int simd_equal_u32(const u32 *a, const u32 *b, size_t n);
+
+#endif
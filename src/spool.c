@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "spool.h"
+#include "util.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+
+/* Without a file the spool keeps to memory */
+void spool_init(Spool *sp, size_t max, const char *path)
+{
+	sp->len = 0;
+	sp->cap = max;
+	sp->queues = smalloc(max * sizeof(*sp->queues));
+	trie_init(&sp->index, max);
+	sp->file_len = 0;
+	sp->on_disk = 0;
+	if((sp->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600)) < 0)
+	{
+		perror("open spool");
+	}
+}
+
+void spool_free(Spool *sp, const char *path)
+{
+	for(size_t i = 0; i < sp->len; ++i)
+	{
+		SpoolQueue *q = sp->queues + i;
+		for(size_t j = 0; j < q->len; ++j)
+		{
+			sfree(q->ring[(q->head + j) % SPOOL_MAX].frame);
+		}
+
+		sfree(q->ring);
+	}
+
+	sfree(sp->queues);
+	trie_free(&sp->index);
+	if(sp->fd >= 0)
+	{
+		close(sp->fd);
+		unlink(path);
+	}
+}
+
+SpoolQueue *spool_find(Spool *sp, ip_addr dst)
+{
+	u32 idx = trie_find(&sp->index, dst, 32);
+	return idx == TRIE_NIL ? NULL : sp->queues + idx;
+}
+
+static SpoolQueue *spool_queue(Spool *sp, ip_addr dst)
+{
+	SpoolQueue *q;
+	if((q = spool_find(sp, dst)))
+	{
+		return q;
+	}
+
+	if(sp->len >= sp->cap || trie_insert(&sp->index, dst, 32, sp->len))
+	{
+		return NULL;
+	}
+
+	q = sp->queues + sp->len++;
+	q->dst = dst;
+	q->head = 0;
+	q->len = 0;
+	q->in_mem = 0;
+	q->ring = smalloc(SPOOL_MAX * sizeof(*q->ring));
+	return q;
+}
+
+/* Takes ownership of frame, a PVL_MESSAGE, unless it returns -1 because
+   the spool of dst is full */
+int spool_push(Spool *sp, ip_addr dst, u8 *frame, size_t len, void *ctx)
+{
+	SpoolQueue *q;
+	SpoolEntry *e;
+	if(!(q = spool_queue(sp, dst)) || q->len >= SPOOL_MAX)
+	{
+		return -1;
+	}
+
+	e = q->ring + (q->head + q->len) % SPOOL_MAX;
+	e->len = len;
+	e->ctx = ctx;
+	if(q->in_mem < SPOOL_MEM)
+	{
+		e->frame = frame;
+		++q->in_mem;
+	}
+	else
+	{
+		if(sp->fd < 0 || write(sp->fd, frame, len) != (ssize_t)len)
+		{
+			return -1;
+		}
+
+		e->frame = NULL;
+		e->off = sp->file_len;
+		sp->file_len += len;
+		++sp->on_disk;
+		sfree(frame);
+	}
+
+	++q->len;
+	return 0;
+}
+
+const SpoolEntry *spool_head(const SpoolQueue *q)
+{
+	return q->len ? q->ring + q->head : NULL;
+}
+
+/* Removes the oldest frame of q and returns it, NULL if it could not be
+   read back from the file */
+u8 *spool_pop(Spool *sp, SpoolQueue *q, size_t *len)
+{
+	SpoolEntry *e = q->ring + q->head;
+	u8 *frame = e->frame;
+	q->head = (q->head + 1) % SPOOL_MAX;
+	--q->len;
+	*len = e->len;
+	if(frame)
+	{
+		--q->in_mem;
+		return frame;
+	}
+
+	frame = smalloc(e->len);
+	if(pread(sp->fd, frame, e->len, e->off) != (ssize_t)e->len)
+	{
+		sfree(frame);
+		frame = NULL;
+	}
+
+	if(!--sp->on_disk && !ftruncate(sp->fd, 0))
+	{
+		sp->file_len = 0;
+	}
+
+	return frame;
+}
@@ -0,0 +1,50 @@
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include "net_util.h"
+#include "trie.h"
+
+#define SPOOL_MEM            64
+#define SPOOL_MAX          1024
+#define SPOOL_DSTS          256
+
+/* A spooled frame, kept in memory or, if frame is NULL, in the spool
+   file at off. ctx belongs to the caller, the spool only keeps it. */
+typedef struct
+{
+	u8 *frame;
+	u32 len;
+	u64 off;
+	void *ctx;
+} SpoolEntry;
+
+/* Frames waiting for a route to dst, in the order they were spooled */
+typedef struct
+{
+	ip_addr dst;
+	size_t head, len;
+	size_t in_mem;
+	SpoolEntry *ring;
+} SpoolQueue;
+
+/* Per destination spools. The first SPOOL_MEM frames of a destination
+   stay in memory, further ones are appended to a file that is truncated
+   once nothing in it is live. */
+typedef struct
+{
+	size_t len, cap;
+	SpoolQueue *queues;
+	Trie index;
+	int fd;
+	u64 file_len;
+	size_t on_disk;
+} Spool;
+
+void spool_init(Spool *sp, size_t max, const char *path);
+void spool_free(Spool *sp, const char *path);
+int spool_push(Spool *sp, ip_addr dst, u8 *frame, size_t len, void *ctx);
+SpoolQueue *spool_find(Spool *sp, ip_addr dst);
+const SpoolEntry *spool_head(const SpoolQueue *q);
+u8 *spool_pop(Spool *sp, SpoolQueue *q, size_t *len);
+
+#endif
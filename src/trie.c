@@ -0,0 +1,159 @@
+#include "trie.h"
+#include "util.h"
+#include <string.h>
+
+/* Path compressed binary radix tree (Patricia trie) over IPv4 prefixes.
+   Every key needs at most one extra branch node, so 2 * max_keys nodes
+   are allocated up front and deletion is done by clearing and
+   reinserting. */
+
+static u32 trie_bit(ip_addr key, u32 pos)
+{
+	return (key >> (31 - pos)) & 1;
+}
+
+static u32 trie_common(ip_addr a, u32 alen, ip_addr b, u32 blen)
+{
+	u32 x = a ^ b;
+	u32 common = x ? (u32)__builtin_clz(x) : 32;
+	if(common > alen) { common = alen; }
+	if(common > blen) { common = blen; }
+	return common;
+}
+
+static u32 trie_alloc(Trie *t, ip_addr key, u32 plen, u32 value)
+{
+	TrieNode *n = t->nodes + t->len;
+	n->key = key;
+	n->plen = plen;
+	n->value = value;
+	n->child[0] = TRIE_NIL;
+	n->child[1] = TRIE_NIL;
+	return t->len++;
+}
+
+void trie_init(Trie *t, size_t max_keys)
+{
+	t->cap = 2 * max_keys + 1;
+	t->nodes = smalloc(t->cap * sizeof(TrieNode));
+	trie_clear(t);
+}
+
+void trie_free(Trie *t)
+{
+	sfree(t->nodes);
+}
+
+void trie_clear(Trie *t)
+{
+	t->root = TRIE_NIL;
+	t->len = 0;
+}
+
+void trie_copy(Trie *dst, const Trie *src)
+{
+	dst->root = src->root;
+	dst->len = src->len;
+	memcpy(dst->nodes, src->nodes, src->len * sizeof(TrieNode));
+}
+
+int trie_insert(Trie *t, ip_addr key, u32 plen, u32 value)
+{
+	u32 *link = &t->root;
+	key &= ip_mask(plen);
+	while(*link != TRIE_NIL)
+	{
+		u32 idx = *link, mid, common;
+		TrieNode *n = t->nodes + idx;
+		common = trie_common(key, plen, n->key, n->plen);
+		if(common == n->plen)
+		{
+			if(plen == n->plen)
+			{
+				n->value = value;
+				return 0;
+			}
+
+			link = n->child + trie_bit(key, n->plen);
+			continue;
+		}
+
+		if(t->len + 2 > t->cap)
+		{
+			return -1;
+		}
+
+		if(common == plen)
+		{
+			mid = trie_alloc(t, key, plen, value);
+		}
+		else
+		{
+			mid = trie_alloc(t, key & ip_mask(common), common, TRIE_NIL);
+			t->nodes[mid].child[trie_bit(key, common)] =
+				trie_alloc(t, key, plen, value);
+		}
+
+		t->nodes[mid].child[trie_bit(n->key, common)] = idx;
+		*link = mid;
+		return 0;
+	}
+
+	if(t->len >= t->cap)
+	{
+		return -1;
+	}
+
+	*link = trie_alloc(t, key, plen, value);
+	return 0;
+}
+
+u32 trie_find(const Trie *t, ip_addr key, u32 plen)
+{
+	u32 idx = t->root;
+	key &= ip_mask(plen);
+	while(idx != TRIE_NIL)
+	{
+		const TrieNode *n = t->nodes + idx;
+		if(n->plen > plen || (key & ip_mask(n->plen)) != n->key)
+		{
+			break;
+		}
+
+		if(n->plen == plen)
+		{
+			return n->value;
+		}
+
+		idx = n->child[trie_bit(key, n->plen)];
+	}
+
+	return TRIE_NIL;
+}
+
+u32 trie_lookup(const Trie *t, ip_addr addr)
+{
+	u32 idx = t->root, best = TRIE_NIL;
+	while(idx != TRIE_NIL)
+	{
+		const TrieNode *n = t->nodes + idx;
+		if((addr & ip_mask(n->plen)) != n->key)
+		{
+			break;
+		}
+
+		if(n->value != TRIE_NIL)
+		{
+			best = n->value;
+		}
+
+		if(n->plen == 32)
+		{
+			break;
+		}
+
+		idx = n->child[trie_bit(addr, n->plen)];
+	}
+
+	return best;
+}
@@ -0,0 +1,30 @@
+#ifndef __TRIE_H__
+#define __TRIE_H__
+
+#include "net_util.h"
+
+#define TRIE_NIL 0xFFFFFFFFu
+
+typedef struct
+{
+	ip_addr key;
+	u32 plen;
+	u32 value;
+	u32 child[2];
+} TrieNode;
+
+typedef struct
+{
+	u32 root, len, cap;
+	TrieNode *nodes;
+} Trie;
+
+void trie_init(Trie *t, size_t max_keys);
+void trie_free(Trie *t);
+void trie_clear(Trie *t);
+void trie_copy(Trie *dst, const Trie *src);
+int trie_insert(Trie *t, ip_addr key, u32 plen, u32 value);
+u32 trie_find(const Trie *t, ip_addr key, u32 plen);
+u32 trie_lookup(const Trie *t, ip_addr addr);
+
+#endif
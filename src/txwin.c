@@ -0,0 +1,377 @@
+#include "txwin.h"
+#include "util.h"
+#include <string.h>
+
+void txwin_init(TxWin *tw, size_t max, u32 seed,
+	void (*send)(ip_addr dst, const u8 *frame, size_t len))
+{
+	tw->len = 0;
+	tw->cap = max;
+	tw->peers = smalloc(max * sizeof(*tw->peers));
+	tw->seed = seed ? seed : 1;
+	tw->send = send;
+	trie_init(&tw->index, max);
+}
+
+static void txwin_release(TxEntry *e)
+{
+	sfree(e->frame);
+	e->frame = NULL;
+}
+
+/* Messages still queued complete with TX_DROPPED */
+void txwin_free(TxWin *tw)
+{
+	for(size_t i = 0; i < tw->len; ++i)
+	{
+		TxPeer *p = tw->peers + i;
+		for(u32 id = p->base; id != p->next; ++id)
+		{
+			TxEntry *e = p->ring + id % TX_QUEUE;
+			if(e->done)
+			{
+				continue;
+			}
+
+			txwin_release(e);
+			if(e->cb)
+			{
+				e->cb(p->dst, id, TX_DROPPED, e->ctx);
+			}
+		}
+
+		sfree(p->ring);
+	}
+
+	sfree(tw->peers);
+	trie_free(&tw->index);
+}
+
+static u32 txwin_random(TxWin *tw)
+{
+	u32 x = tw->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return tw->seed = x;
+}
+
+/* Ids start at a random point so that a restarted sender is not taken
+   for a duplicate and a NACK, which only names the id, can be matched
+   to its destination. Small ids are left to the terminal line tags. */
+static TxPeer *txwin_peer(TxWin *tw, ip_addr dst)
+{
+	TxPeer *p;
+	u32 idx = trie_find(&tw->index, dst, 32);
+	if(idx != TRIE_NIL)
+	{
+		return tw->peers + idx;
+	}
+
+	if(tw->len >= tw->cap || trie_insert(&tw->index, dst, 32, tw->len))
+	{
+		return NULL;
+	}
+
+	p = tw->peers + tw->len++;
+	p->dst = dst;
+	p->base = (txwin_random(tw) & 0x7FFFFFFF) | 0x100;
+	p->unsent = p->base;
+	p->high = p->base;
+	p->next = p->base;
+	p->srtt = 0;
+	p->rttvar = 0;
+	p->rto = TX_RTO_INIT;
+	p->cwnd = TX_CWND_INIT;
+	p->ssthresh = TX_WINDOW;
+	p->acked = 0;
+	p->recover = p->base;
+	p->ring = scalloc(TX_QUEUE * sizeof(*p->ring));
+	return p;
+}
+
+static int txwin_contains(const TxPeer *p, u32 msgid)
+{
+	return msgid - p->base < p->next - p->base;
+}
+
+/* Jacobson/Karels estimator, only fed by messages sent once (Karn) */
+static void txwin_rtt_sample(TxPeer *p, u64 rtt)
+{
+	if(!p->srtt)
+	{
+		p->srtt = rtt;
+		p->rttvar = rtt / 2;
+	}
+	else
+	{
+		u32 err = rtt > p->srtt ? rtt - p->srtt : p->srtt - rtt;
+		p->rttvar = (3 * (u64)p->rttvar + err) / 4;
+		p->srtt = (7 * (u64)p->srtt + rtt) / 8;
+	}
+
+	p->rto = p->srtt + 4 * p->rttvar;
+	if(p->rto < TX_RTO_MIN)
+	{
+		p->rto = TX_RTO_MIN;
+	}
+	else if(p->rto > TX_RTO_MAX)
+	{
+		p->rto = TX_RTO_MAX;
+	}
+}
+
+/* Slow start below ssthresh, then one message more per window */
+static void txwin_grow(TxPeer *p)
+{
+	if(p->cwnd >= TX_WINDOW)
+	{
+		return;
+	}
+
+	if(p->cwnd < p->ssthresh || ++p->acked >= p->cwnd)
+	{
+		++p->cwnd;
+		p->acked = 0;
+	}
+}
+
+/* Halves the window, at most once per window of messages in flight:
+   the next reduction waits until base has reached recover */
+static void txwin_shrink(TxPeer *p)
+{
+	if((int32_t)(p->recover - p->base) > 0)
+	{
+		return;
+	}
+
+	p->cwnd = p->cwnd > 2 ? p->cwnd / 2 : 1;
+	p->ssthresh = p->cwnd > 2 ? p->cwnd : 2;
+	p->acked = 0;
+	p->recover = p->high;
+}
+
+static void txwin_transmit(TxWin *tw, TxPeer *p, TxEntry *e, u64 now)
+{
+	e->sent = now;
+	e->due = now + p->rto;
+	++e->tries;
+	tw->send(p->dst, e->frame, e->len);
+}
+
+/* Sends queued messages as far as the window allows. Messages that
+   were acknowledged selectively are not sent again. */
+static void txwin_pump(TxWin *tw, TxPeer *p, u64 now)
+{
+	while(p->unsent != p->next && p->unsent - p->base < p->cwnd)
+	{
+		TxEntry *e = p->ring + p->unsent % TX_QUEUE;
+		if(!e->done)
+		{
+			txwin_transmit(tw, p, e, now);
+		}
+
+		if(++p->unsent - p->base > p->high - p->base)
+		{
+			p->high = p->unsent;
+		}
+	}
+}
+
+static void txwin_complete(TxPeer *p, u32 msgid, int status)
+{
+	TxEntry *e = p->ring + msgid % TX_QUEUE;
+	if(e->done)
+	{
+		return;
+	}
+
+	e->done = 1;
+	txwin_release(e);
+	if(e->cb)
+	{
+		e->cb(p->dst, msgid, status, e->ctx);
+	}
+
+	while(p->base != p->high && p->ring[p->base % TX_QUEUE].done)
+	{
+		++p->base;
+	}
+
+	if(p->unsent - p->base > p->high - p->base)
+	{
+		p->unsent = p->base;
+	}
+}
+
+/* Reserves the id for the next message to dst. Returns -1 if its queue
+   is full. The message must then be handed to txwin_submit(). */
+int txwin_next_id(TxWin *tw, ip_addr dst, u32 *msgid)
+{
+	TxPeer *p;
+	if(!(p = txwin_peer(tw, dst)) || p->next - p->base >= TX_QUEUE)
+	{
+		return -1;
+	}
+
+	*msgid = p->next;
+	return 0;
+}
+
+/* Takes ownership of frame, which carries the id from txwin_next_id() */
+void txwin_submit(TxWin *tw, ip_addr dst, u8 *frame, size_t len,
+	TxDone cb, void *ctx, u64 now)
+{
+	TxPeer *p = txwin_peer(tw, dst);
+	TxEntry *e = p->ring + p->next % TX_QUEUE;
+	e->frame = frame;
+	e->len = len;
+	e->tries = 0;
+	e->done = 0;
+	e->cb = cb;
+	e->ctx = ctx;
+	++p->next;
+	txwin_pump(tw, p, now);
+}
+
+void txwin_ack(TxWin *tw, ip_addr dst, u32 msgid, u64 now)
+{
+	txwin_sack(tw, dst, msgid, 1, 0, now);
+}
+
+/* A message in flight that TX_DUP_SACKS later ones overtook was lost.
+   It is sent again without waiting for its timeout, at most once per
+   round trip, and the window is halved as for a CE mark. */
+static void txwin_fast_retransmit(TxWin *tw, TxPeer *p, u64 now)
+{
+	u32 rtt = p->srtt ? p->srtt : TX_RTO_MIN;
+	u32 overtaken = 0;
+	for(u32 id = p->unsent; id != p->base; )
+	{
+		TxEntry *e = p->ring + --id % TX_QUEUE;
+		if(e->done)
+		{
+			++overtaken;
+		}
+		else if(overtaken >= TX_DUP_SACKS && e->tries < TX_MAX_TRIES &&
+			now - e->sent >= rtt)
+		{
+			txwin_shrink(p);
+			txwin_transmit(tw, p, e, now);
+		}
+	}
+}
+
+/* Acknowledges top and every id below it whose bit is set in map, bit i
+   standing for top - i. Only top, the message that triggered the SACK,
+   gives an RTT sample. ce echoes a congestion mark set by a relay. */
+void txwin_sack(TxWin *tw, ip_addr dst, u32 top, u64 map, int ce, u64 now)
+{
+	TxPeer *p;
+	u32 idx = trie_find(&tw->index, dst, 32);
+	if(idx == TRIE_NIL)
+	{
+		return;
+	}
+
+	p = tw->peers + idx;
+	for(u32 id = p->base; id != p->high; ++id)
+	{
+		TxEntry *e = p->ring + id % TX_QUEUE;
+		u32 d = top - id;
+		if(e->done || d >= 64 || !((map >> d) & 1))
+		{
+			continue;
+		}
+
+		if(d == 0 && e->tries == 1)
+		{
+			txwin_rtt_sample(p, now - e->sent);
+		}
+
+		txwin_complete(p, id, TX_ACKED);
+		txwin_grow(p);
+	}
+
+	if(ce)
+	{
+		txwin_shrink(p);
+	}
+
+	txwin_fast_retransmit(tw, p, now);
+	txwin_pump(tw, p, now);
+}
+
+/* A NACK names the message by id only; ids of different destinations
+   don't overlap in practice because they start at random points */
+static TxPeer *txwin_sent_by_id(TxWin *tw, u32 msgid)
+{
+	for(size_t i = 0; i < tw->len; ++i)
+	{
+		TxPeer *p = tw->peers + i;
+		if(txwin_contains(p, msgid) &&
+			msgid - p->base < p->high - p->base)
+		{
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+void txwin_fail(TxWin *tw, u32 msgid)
+{
+	TxPeer *p;
+	if((p = txwin_sent_by_id(tw, msgid)))
+	{
+		txwin_complete(p, msgid, TX_FAILED);
+	}
+}
+
+/* A relay dropped the message, which counts like a congestion mark */
+void txwin_congested(TxWin *tw, u32 msgid)
+{
+	TxPeer *p;
+	if((p = txwin_sent_by_id(tw, msgid)))
+	{
+		txwin_shrink(p);
+	}
+}
+
+/* Gives up on messages after TX_MAX_TRIES. When the timeout of the
+   oldest message in flight expires, the timeout of the destination backs
+   off exponentially, its congestion window starts over from one message
+   and only that message is sent again. The ones after it fall back to
+   unsent and follow as acknowledgements open the window. */
+void txwin_timers(TxWin *tw, u64 now)
+{
+	for(size_t i = 0; i < tw->len; ++i)
+	{
+		TxPeer *p = tw->peers + i;
+		for(u32 id = p->base; id != p->unsent; ++id)
+		{
+			TxEntry *e = p->ring + id % TX_QUEUE;
+			if(e->done || e->due > now)
+			{
+				continue;
+			}
+
+			if(e->tries >= TX_MAX_TRIES)
+			{
+				txwin_complete(p, id, TX_TIMEOUT);
+				continue;
+			}
+
+			p->rto = p->rto * 2 < TX_RTO_MAX ? p->rto * 2 : TX_RTO_MAX;
+			p->ssthresh = p->cwnd > 4 ? p->cwnd / 2 : 2;
+			p->cwnd = 1;
+			p->acked = 0;
+			p->recover = p->high;
+			txwin_transmit(tw, p, e, now);
+			p->unsent = id + 1;
+			break;
+		}
+
+		txwin_pump(tw, p, now);
+	}
+}
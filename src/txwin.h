@@ -0,0 +1,82 @@
+#ifndef __TXWIN_H__
+#define __TXWIN_H__
+
+#include "net_util.h"
+#include "trie.h"
+
+#define TX_WINDOW            32
+#define TX_QUEUE            256
+#define TX_MAX_TRIES          8
+#define TX_RTO_INIT     1000000
+#define TX_RTO_MIN       300000
+#define TX_RTO_MAX     10000000
+#define TX_CWND_INIT          4
+#define TX_DUP_SACKS          3
+
+enum
+{
+	TX_ACKED,
+	TX_FAILED,
+	TX_TIMEOUT,
+	TX_DROPPED
+};
+
+typedef void (*TxDone)(ip_addr dst, u32 msgid, int status, void *ctx);
+
+typedef struct
+{
+	u8 *frame;
+	size_t len;
+	u64 sent;
+	u64 due;
+	u32 tries;
+	int done;
+	TxDone cb;
+	void *ctx;
+} TxEntry;
+
+/* Messages to one destination carry consecutive ids from a random
+   start. Ids in [base, next) are queued, the ones below high have been
+   sent at least once and the ones below unsent are in flight. A timeout
+   moves unsent back, the messages after it are then sent again as the
+   window allows. At most cwnd ids past base may be in flight, the
+   congestion window grows by AIMD up to TX_WINDOW. */
+typedef struct
+{
+	ip_addr dst;
+	u32 base;
+	u32 unsent;
+	u32 high;
+	u32 next;
+	u32 srtt;
+	u32 rttvar;
+	u32 rto;
+	u32 cwnd;
+	u32 ssthresh;
+	u32 acked;
+	u32 recover;
+	TxEntry *ring;
+} TxPeer;
+
+typedef struct
+{
+	size_t len, cap;
+	TxPeer *peers;
+	Trie index;
+	u32 seed;
+	void (*send)(ip_addr dst, const u8 *frame, size_t len);
+} TxWin;
+
+void txwin_init(TxWin *tw, size_t max, u32 seed,
+	void (*send)(ip_addr dst, const u8 *frame, size_t len));
+void txwin_free(TxWin *tw);
+int txwin_next_id(TxWin *tw, ip_addr dst, u32 *msgid);
+void txwin_submit(TxWin *tw, ip_addr dst, u8 *frame, size_t len,
+	TxDone cb, void *ctx, u64 now);
+void txwin_ack(TxWin *tw, ip_addr dst, u32 msgid, u64 now);
+void txwin_sack(TxWin *tw, ip_addr dst, u32 top, u64 map, int ce, u64 now);
+void txwin_fail(TxWin *tw, u32 msgid);
+void txwin_congested(TxWin *tw, u32 msgid);
+void txwin_timers(TxWin *tw, u64 now);
+
+#endif
@@ -1,7 +1,9 @@
+#define _POSIX_C_SOURCE 199309L
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static size_t alloc_cnt, free_cnt, total_bytes;
 
@@ -76,3 +78,10 @@ size_t filter(void *base, size_t num, size_t width, const void *data,
 
 	return count;
 }
+
+u64 time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + (u64)ts.tv_nsec / 1000;
+}
@@ -14,5 +14,6 @@ void sfree(void *p);
 void print_allocs(void);
 size_t filter(void *base, size_t num, size_t width, const void *data,
 	int (*keep)(void *elem, const void *data));
+u64 time_us(void);
 
 #endif
@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+#include "xfer.h"
+#include "crc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void xfer_basename(char *out, const char *path)
+{
+	const char *base = strrchr(path, '/');
+	snprintf(out, XFER_NAME, "%s", base ? base + 1 : path);
+}
+
+XferSend *xfer_send_open(Xfers *x, ip_addr dst, u32 id, const char *path)
+{
+	XferSend *s;
+	struct stat st;
+	void *map;
+	int fd;
+	if(x->num_send >= XFER_MAX || (fd = open(path, O_RDONLY)) < 0)
+	{
+		return NULL;
+	}
+
+	if(fstat(fd, &st) || !st.st_size || st.st_size > 0xFFFFFFFF ||
+		(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	s = x->send + x->num_send++;
+	s->dst = dst;
+	s->id = id;
+	s->map = map;
+	s->size = st.st_size;
+	s->acked = 0;
+	s->next = 0;
+	s->started = 0;
+	s->tries = 0;
+	s->dups = 0;
+	s->due = 0;
+	s->sum = crc_update(0, s->map, s->size);
+	xfer_basename(s->name, path);
+	return s;
+}
+
+XferSend *xfer_send_find(Xfers *x, ip_addr dst, u32 id)
+{
+	for(size_t i = 0; i < x->num_send; ++i)
+	{
+		if(x->send[i].dst == dst && x->send[i].id == id)
+		{
+			return x->send + i;
+		}
+	}
+
+	return NULL;
+}
+
+void xfer_send_close(Xfers *x, XferSend *s)
+{
+	munmap((void *)s->map, s->size);
+	*s = x->send[--x->num_send];
+}
+
+/* The receiver reports the offset it continues at, which may be past
+   what was sent when it resumes a transfer. Repeated reports of the
+   same offset mean a chunk was lost, after XFER_DUP_ACKS the window is
+   sent again from there, without waiting for the timeout; the reports
+   the rest of that window triggers are ignored. Returns 1 if chunks
+   should be sent. */
+int xfer_send_ack(XferSend *s, u32 off, u64 now)
+{
+	if(off > s->size)
+	{
+		return 0;
+	}
+
+	if(s->started && off <= s->acked)
+	{
+		if(off == s->acked && s->next > off && ++s->dups == XFER_DUP_ACKS)
+		{
+			s->next = off;
+			s->dups = -XFER_WINDOW;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	s->started = 1;
+	s->acked = off;
+	if(s->next < off)
+	{
+		s->next = off;
+	}
+
+	s->tries = 0;
+	s->dups = 0;
+	s->due = now + XFER_RTO;
+	return 1;
+}
+
+/* Records an offer, nothing is written before it is accepted */
+XferRecv *xfer_recv_offer(Xfers *x, ip_addr src, u32 id,
+	const char *name, u32 size, u32 sum)
+{
+	XferRecv *r;
+	if(x->num_recv >= XFER_MAX)
+	{
+		return NULL;
+	}
+
+	r = x->recv + x->num_recv;
+	xfer_basename(r->name, name);
+	if(!r->name[0] || r->name[0] == '.')
+	{
+		return NULL;
+	}
+
+	++x->num_recv;
+	r->src = src;
+	r->id = id;
+	r->num = ++x->seq;
+	r->accepted = 0;
+	r->fd = -1;
+	r->size = size;
+	r->sum = sum;
+	r->crc = 0;
+	r->off = 0;
+	r->unacked = 0;
+	r->seen = 0;
+	r->path[0] = '\0';
+	return r;
+}
+
+/* Opens the part file in dir. One left by an earlier attempt at the same
+   file is resumed where that one stopped, its content is read back for
+   the CRC. */
+int xfer_recv_accept(XferRecv *r, const char *dir)
+{
+	u8 buf[16384];
+	struct stat st;
+	u32 off = 0, len;
+	int fd;
+	if(mkdir(dir, 0755) && errno != EEXIST)
+	{
+		return -1;
+	}
+
+	snprintf(r->path, sizeof(r->path), "%s/%s.%u-%08x.part",
+		dir, r->name, r->size, r->sum);
+	if((fd = open(r->path, O_RDWR | O_CREAT, 0644)) < 0)
+	{
+		return -1;
+	}
+
+	if(fstat(fd, &st))
+	{
+		st.st_size = 0;
+	}
+
+	len = st.st_size > r->size ? 0 : st.st_size;
+	r->crc = 0;
+	while(off < len)
+	{
+		size_t n = len - off < sizeof(buf) ? len - off : sizeof(buf);
+		ssize_t got = pread(fd, buf, n, off);
+		if(got <= 0)
+		{
+			break;
+		}
+
+		r->crc = crc_update(r->crc, buf, got);
+		off += got;
+	}
+
+	if(off != st.st_size && ftruncate(fd, off))
+	{
+		close(fd);
+		return -1;
+	}
+
+	fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, r->size);
+	r->fd = fd;
+	r->off = off;
+	r->accepted = 1;
+	return 0;
+}
+
+XferRecv *xfer_recv_find(Xfers *x, ip_addr src, u32 id)
+{
+	for(size_t i = 0; i < x->num_recv; ++i)
+	{
+		if(x->recv[i].src == src && x->recv[i].id == id)
+		{
+			return x->recv + i;
+		}
+	}
+
+	return NULL;
+}
+
+XferRecv *xfer_recv_find_num(Xfers *x, u32 num)
+{
+	for(size_t i = 0; i < x->num_recv; ++i)
+	{
+		if(x->recv[i].num == num)
+		{
+			return x->recv + i;
+		}
+	}
+
+	return NULL;
+}
+
+/* Chunks are only taken in order, the sender goes back to the offset
+   the receiver reports. Returns -1 for a chunk out of order. */
+int xfer_recv_write(XferRecv *r, u32 off, const u8 *data, size_t len)
+{
+	if(r->fd < 0 || off != r->off || len > r->size - r->off)
+	{
+		return -1;
+	}
+
+	if(pwrite(r->fd, data, len, off) != (ssize_t)len)
+	{
+		return -1;
+	}
+
+	r->crc = crc_update(r->crc, data, len);
+	r->off += len;
+	return 0;
+}
+
+/* A complete file whose CRC matches the offer is linked into dir under
+   its name, or name.1 and so on if that is taken, so nothing there is
+   replaced. A corrupt one is removed, an incomplete one kept for a
+   resume. The name it was saved under is left in name. */
+int xfer_recv_finish(XferRecv *r, const char *dir)
+{
+	char path[XFER_PATH];
+	if(r->fd < 0)
+	{
+		return XFER_INCOMPLETE;
+	}
+
+	close(r->fd);
+	r->fd = -1;
+	if(r->off != r->size)
+	{
+		return XFER_INCOMPLETE;
+	}
+
+	if(r->crc != r->sum)
+	{
+		unlink(r->path);
+		return XFER_CORRUPT;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", dir, r->name);
+	for(u32 i = 1; link(r->path, path); ++i)
+	{
+		if(errno != EEXIST || i > 99)
+		{
+			return XFER_INCOMPLETE;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s.%u", dir, r->name, i);
+	}
+
+	unlink(r->path);
+	snprintf(r->name, sizeof(r->name), "%s", path + strlen(dir) + 1);
+	return XFER_SAVED;
+}
+
+void xfer_recv_close(Xfers *x, XferRecv *r)
+{
+	if(r->fd >= 0)
+	{
+		close(r->fd);
+	}
+
+	*r = x->recv[--x->num_recv];
+}
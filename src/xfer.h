@@ -0,0 +1,88 @@
+#ifndef __XFER_H__
+#define __XFER_H__
+
+#include "net_util.h"
+
+#define XFER_MAX              4
+#define XFER_CHUNK          768
+#define XFER_WINDOW          16
+#define XFER_ACK_EVERY        4
+#define XFER_DUP_ACKS         3
+#define XFER_RTO        1000000
+#define XFER_MAX_TRIES       10
+#define XFER_OFFER_TRIES     60
+#define XFER_NAME            64
+#define XFER_PATH           256
+
+/* An outgoing file, mapped read only. Bytes below acked arrived, the
+   ones up to next are in flight. sum is the CRC of the whole file. */
+typedef struct
+{
+	ip_addr dst;
+	u32 id;
+	const u8 *map;
+	u32 size;
+	u32 sum;
+	u32 acked;
+	u32 next;
+	int started;
+	u32 tries;
+	int dups;
+	u64 due;
+	char name[XFER_NAME];
+} XferSend;
+
+/* An incoming file. It is only an offer, with fd -1, until it is
+   accepted under the local number num. It is then written in order
+   into a part file in the download directory whose name carries size
+   and sum, so only a part of the same file is resumed. The part file
+   has its blocks reserved up front but grows only as chunks are
+   written, so its size is where a resumed transfer continues. A
+   finished transfer is kept a while with fd -1 to answer retransmits. */
+typedef struct
+{
+	ip_addr src;
+	u32 id;
+	u32 num;
+	int accepted;
+	int fd;
+	u32 size;
+	u32 sum;
+	u32 crc;
+	u32 off;
+	u32 unacked;
+	u64 seen;
+	char name[XFER_NAME];
+	char path[XFER_PATH];
+} XferRecv;
+
+typedef struct
+{
+	size_t num_send, num_recv;
+	u32 seq;
+	XferSend send[XFER_MAX];
+	XferRecv recv[XFER_MAX];
+} Xfers;
+
+enum
+{
+	XFER_INCOMPLETE,
+	XFER_SAVED,
+	XFER_CORRUPT
+};
+
+XferSend *xfer_send_open(Xfers *x, ip_addr dst, u32 id, const char *path);
+XferSend *xfer_send_find(Xfers *x, ip_addr dst, u32 id);
+void xfer_send_close(Xfers *x, XferSend *s);
+int xfer_send_ack(XferSend *s, u32 off, u64 now);
+
+XferRecv *xfer_recv_offer(Xfers *x, ip_addr src, u32 id,
+	const char *name, u32 size, u32 sum);
+int xfer_recv_accept(XferRecv *r, const char *dir);
+XferRecv *xfer_recv_find(Xfers *x, ip_addr src, u32 id);
+XferRecv *xfer_recv_find_num(Xfers *x, u32 num);
+int xfer_recv_write(XferRecv *r, u32 off, const u8 *data, size_t len);
+int xfer_recv_finish(XferRecv *r, const char *dir);
+void xfer_recv_close(Xfers *x, XferRecv *r);
+
+#endif